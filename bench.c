@@ -0,0 +1,525 @@
+/*
+ Public Domain (www.unlicense.org)
+ This is free and unencumbered software released into the public domain.
+ Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+ software, either in source code form or as a compiled binary, for any purpose,
+ commercial or non-commercial, and by any means.
+
+ Per-kernel microbenchmarks for the layer 3 decoder.
+
+ The decoder kernels are all static, so pdmp3.c is included directly. A file
+ is decoded once while the input of every stage is captured per frame; each
+ kernel is then timed in isolation on that captured data.
+
+ Output is one CSV line per kernel. All figures are per granule, i.e. both
+ channels of one granule for stereo streams and 32 IMDCT_Win calls per
+ channel for the imdct_win_bt* rows. The batch_* rows fill all lanes of a
+ pdmp3_batch kernel call with copies of the stream and are also reported per
+ granule of one stream. Columns that need perf_event_open
+ are reported as nan when it isn't available.
+
+ With -a the program instead compares the S16 output of a decoder build
+ against the output of the reference build, and classifies the deviation
+ according to the ISO/IEC 11172-4 compliance limits.
+*/
+#include "pdmp3.c"
+
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define BENCH_MAX_FRAMES 256
+#define BENCH_REPEAT      20
+
+enum { /* Captured input of each stage */
+  BENCH_IN_REQUANTIZE = 0,
+  BENCH_IN_REORDER,
+  BENCH_IN_STEREO,
+  BENCH_IN_ANTIALIAS,
+  BENCH_IN_HYBRID,
+  BENCH_IN_SUBBAND,
+  BENCH_IN_NUM
+};
+
+typedef struct {
+  t_mpeg1_header hdr;
+  t_mpeg1_side_info side;            /* count1 as set by Read_Huffman */
+  t_mpeg1_main_data main;            /* scalefactors */
+  unsigned huff_start[2][2];         /* Huffman data bit pos.,[gr][ch] */
+  unsigned part_2_start[2][2];       /* Scalefactor bit pos.,[gr][ch] */
+  unsigned char reservoir[sizeof(((pdmp3_handle *)0)->g_main_data_vec)];
+  float is[BENCH_IN_NUM][2][2][576]; /* Stage inputs,[stage][gr][ch][] */
+}
+bench_frame;
+
+typedef struct {
+  uint64_t n,ns,tsc,cycles,instructions,cache_misses;
+}
+bench_acc;
+
+typedef struct {
+  uint64_t nr;
+  uint64_t values[3]; /* cycles,instructions,cache misses */
+}
+bench_perf_read;
+
+static bench_frame *frames;
+static int16_t bench_pcm[2*576*2]; /* Subband synthesis output,discarded */
+static unsigned nframes;
+static int perf_fd = -1;
+
+/**Description: returns the number of scalefactor bits of a granule.
+* Parameters: Side info,granule,channel.
+* Return value: part2 length in bits.
+**/
+static unsigned Bench_Part2_Length(t_mpeg1_side_info *si,unsigned gr,unsigned ch){
+  unsigned slen1 = mpeg1_scalefac_sizes[si->scalefac_compress[gr][ch]][0];
+  unsigned slen2 = mpeg1_scalefac_sizes[si->scalefac_compress[gr][ch]][1];
+  unsigned n = 0;
+
+  if((si->win_switch_flag[gr][ch] != 0) &&(si->block_type[gr][ch] == 2)) {
+    if(si->mixed_block_flag[gr][ch] != 0) return(17*slen1 + 18*slen2);
+    return(18*slen1 + 18*slen2);
+  }
+  if((gr == 0) ||(si->scfsi[ch][0] == 0)) n += 6*slen1;
+  if((gr == 0) ||(si->scfsi[ch][1] == 0)) n += 5*slen1;
+  if((gr == 0) ||(si->scfsi[ch][2] == 0)) n += 5*slen2;
+  if((gr == 0) ||(si->scfsi[ch][3] == 0)) n += 5*slen2;
+  return(n);
+}
+
+/**Description: returns how far Read_Main_L3() moves the main data bit
+                position for a granule.
+* Parameters: Side info,granule,channel.
+* Return value: Number of bits.
+**/
+static unsigned Bench_Main_Bits(t_mpeg1_side_info *si,unsigned gr,unsigned ch){
+  if(si->part2_3_length[gr][ch] == 0) return(Bench_Part2_Length(si,gr,ch));
+  return(si->part2_3_length[gr][ch]);
+}
+
+/**Description: returns where the main data of the frame just read starts in
+                the reservoir,main_data_begin bytes before the main
+                data Read_Main_L3() appended to it.
+* Parameters: Stream handle.
+* Return value: Bit position for Set_Main_Pos().
+**/
+static unsigned Bench_Main_Start(pdmp3_handle *id){
+  t_mpeg1_header *h = &id->g_frame_header;
+  unsigned size;
+
+  size =(144 * g_mpeg1_bitrates[h->layer - 1][h->bitrate_index]) /
+    g_sampling_frequency[h->sampling_frequency] + h->padding_bit;
+  size -=(h->mode == mpeg1_mode_single_channel ? 17 : 32) + 4;
+  if(h->protection_bit == 0) size -= 2;
+  return((id->g_main_data_end - size - id->g_side_info.main_data_begin) * 8);
+}
+
+static inline uint64_t Bench_Ns(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return((uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec);
+}
+
+static inline uint64_t Bench_Tsc(void){
+#if defined(__x86_64__) || defined(__i386__)
+  return(__rdtsc());
+#else
+  return(Bench_Ns());
+#endif
+}
+
+static int Bench_Perf_Open_Event(unsigned type,unsigned long long config,int group){
+  struct perf_event_attr pe;
+
+  memset(&pe,0,sizeof(pe));
+  pe.size = sizeof(pe);
+  pe.type = type;
+  pe.config = config;
+  pe.read_format = PERF_FORMAT_GROUP;
+  pe.disabled = (group == -1);
+  pe.exclude_kernel = 1;
+  pe.exclude_hv = 1;
+  return(syscall(__NR_perf_event_open,&pe,0,-1,group,0));
+}
+
+/**Description: opens a cycles/instructions/cache-misses counter group.
+* Parameters: None.
+* Return value: None. perf_fd stays -1 if the counters are unavailable.
+**/
+static void Bench_Perf_Open(void){
+  int fd;
+
+  fd = Bench_Perf_Open_Event(PERF_TYPE_HARDWARE,PERF_COUNT_HW_CPU_CYCLES,-1);
+  if(fd == -1) return;
+  if((Bench_Perf_Open_Event(PERF_TYPE_HARDWARE,PERF_COUNT_HW_INSTRUCTIONS,fd) == -1) ||
+     (Bench_Perf_Open_Event(PERF_TYPE_HARDWARE,PERF_COUNT_HW_CACHE_MISSES,fd) == -1)) {
+    close(fd);
+    return;
+  }
+  ioctl(fd,PERF_EVENT_IOC_RESET,PERF_IOC_FLAG_GROUP);
+  ioctl(fd,PERF_EVENT_IOC_ENABLE,PERF_IOC_FLAG_GROUP);
+  perf_fd = fd;
+}
+
+static inline void Bench_Perf_Read(bench_perf_read *r){
+  if(perf_fd == -1 || read(perf_fd,r,sizeof(*r)) != sizeof(*r))
+    memset(r,0,sizeof(*r));
+}
+
+#define BENCH_TIME(acc,call) do {                                 \
+  bench_perf_read p0_,p1_;                                        \
+  uint64_t t0_,t1_,c0_,c1_;                                       \
+  Bench_Perf_Read(&p0_);                                          \
+  t0_ = Bench_Ns();                                               \
+  c0_ = Bench_Tsc();                                              \
+  call;                                                           \
+  c1_ = Bench_Tsc();                                              \
+  t1_ = Bench_Ns();                                               \
+  Bench_Perf_Read(&p1_);                                          \
+  (acc)->n++;                                                     \
+  (acc)->ns += t1_ - t0_;                                         \
+  (acc)->tsc += c1_ - c0_;                                        \
+  (acc)->cycles += p1_.values[0] - p0_.values[0];                 \
+  (acc)->instructions += p1_.values[1] - p0_.values[1];           \
+  (acc)->cache_misses += p1_.values[2] - p0_.values[2];           \
+} while(0)
+
+/**Description: decodes a file once and captures the input of every stage.
+* Parameters: Stream handle,MP3 data and its size.
+* Return value: Number of captured frames.
+**/
+static unsigned Bench_Capture(pdmp3_handle *id,const unsigned char *data,size_t size){
+  unsigned gr,ch,nch,pos;
+  size_t in = 0;
+  bench_frame *f;
+  int res;
+
+  pdmp3_open_feed(id);
+  while(nframes < BENCH_MAX_FRAMES) {
+    while((in < size) &&(Get_Inbuf_Free(id) > 4096)) {
+      size_t n = (size - in < 4096) ? size - in : 4096;
+      pdmp3_feed(id,data + in,n);
+      in += n;
+    }
+    if(in == size) pdmp3_feed_end(id);
+    if(Get_Inbuf_Filled(id) < (2*576)) {
+      if(in == size) break;
+      continue;
+    }
+    res = Read_Frame(id);
+    if(res != PDMP3_OK) continue; /* Junk or reservoir underflow */
+    f = &frames[nframes++];
+    nch =(id->g_frame_header.mode == mpeg1_mode_single_channel ? 1 : 2);
+    f->hdr = id->g_frame_header;
+    f->side = id->g_side_info;
+    f->main = id->g_main_data;
+    memcpy(f->reservoir,id->g_main_data_vec,sizeof(f->reservoir));
+    /* Each granule moves the bit position by part2_3_length,or just the
+     * scalefactors if there was no Huffman data to read */
+    pos = Bench_Main_Start(id);
+    for(gr = 0; gr < 2; gr++) {
+      for(ch = 0; ch < nch; ch++) {
+        f->part_2_start[gr][ch] = pos;
+        f->huff_start[gr][ch] = pos + Bench_Part2_Length(&f->side,gr,ch);
+        pos += Bench_Main_Bits(&f->side,gr,ch);
+      }
+    }
+    /* The huffman_decode row replays from these positions,check that it
+     * decodes the same spectra */
+    for(gr = 0; gr < 2; gr++) {
+      for(ch = 0; ch < nch; ch++) {
+        Set_Main_Pos(id,f->huff_start[gr][ch]);
+        Read_Huffman(id,f->part_2_start[gr][ch],gr,ch);
+        if(memcmp(id->g_main_data.is[gr][ch],f->main.is[gr][ch],sizeof(f->main.is[gr][ch])))
+          Error("Captured main data doesn't replay\n",1);
+      }
+    }
+    /* Run the reference chain of Decode_L3 and keep each stage's input */
+    for(gr = 0; gr < 2; gr++) {
+      memcpy(f->is[BENCH_IN_REQUANTIZE][gr],id->g_main_data.is[gr],sizeof(f->is[0][0]));
+      for(ch = 0; ch < nch; ch++) L3_Requantize(id,gr,ch);
+      memcpy(f->is[BENCH_IN_REORDER][gr],id->g_main_data.is[gr],sizeof(f->is[0][0]));
+      for(ch = 0; ch < nch; ch++) L3_Reorder(id,gr,ch);
+      memcpy(f->is[BENCH_IN_STEREO][gr],id->g_main_data.is[gr],sizeof(f->is[0][0]));
+      L3_Stereo(id,gr);
+      memcpy(f->is[BENCH_IN_ANTIALIAS][gr],id->g_main_data.is[gr],sizeof(f->is[0][0]));
+      for(ch = 0; ch < nch; ch++) L3_Antialias(id,gr,ch);
+      memcpy(f->is[BENCH_IN_HYBRID][gr],id->g_main_data.is[gr],sizeof(f->is[0][0]));
+      for(ch = 0; ch < nch; ch++) {
+        L3_Hybrid_Synthesis(id,gr,ch);
+        L3_Frequency_Inversion(id,gr,ch);
+      }
+      memcpy(f->is[BENCH_IN_SUBBAND][gr],id->g_main_data.is[gr],sizeof(f->is[0][0]));
+      for(ch = 0; ch < nch; ch++) L3_Subband_Synthesis(id,gr,ch,bench_pcm);
+    }
+  }
+  return(nframes);
+}
+
+static void Bench_Report(const char *kernel,bench_acc *a){
+  double n = a->n ? (double) a->n : 1.0;
+
+  if(perf_fd != -1) {
+    printf("%s,%llu,%.1f,%.1f,%.1f,%.3f,%.3f\n",kernel,(unsigned long long) a->n,
+           a->ns / n,a->tsc / n,a->cycles / n,
+           a->cycles ? (double) a->instructions / a->cycles : 0.0,a->cache_misses / n);
+  }else{
+    printf("%s,%llu,%.1f,%.1f,nan,nan,nan\n",kernel,(unsigned long long) a->n,
+           a->ns / n,a->tsc / n);
+  }
+}
+
+typedef void (*bench_kernel)(pdmp3_handle *id,unsigned gr,unsigned nch);
+
+static unsigned bench_bt; /* Block type for K_IMDCT_Win */
+
+static void K_Requantize(pdmp3_handle *id,unsigned gr,unsigned nch){
+  unsigned ch;
+  for(ch = 0; ch < nch; ch++) L3_Requantize(id,gr,ch);
+}
+
+static void K_Reorder(pdmp3_handle *id,unsigned gr,unsigned nch){
+  unsigned ch;
+  for(ch = 0; ch < nch; ch++) L3_Reorder(id,gr,ch);
+}
+
+static void K_Stereo(pdmp3_handle *id,unsigned gr,unsigned nch){
+  L3_Stereo(id,gr);
+}
+
+static void K_Antialias(pdmp3_handle *id,unsigned gr,unsigned nch){
+  unsigned ch;
+  for(ch = 0; ch < nch; ch++) L3_Antialias(id,gr,ch);
+}
+
+/* Requantize to antialias in the fused sweep Decode_L3() uses */
+static void K_Spectrum(pdmp3_handle *id,unsigned gr,unsigned nch){
+  L3_Spectrum(id,gr);
+}
+
+static void K_IMDCT_Win(pdmp3_handle *id,unsigned gr,unsigned nch){
+  float rawout[36];
+  unsigned ch,sb;
+  for(ch = 0; ch < nch; ch++)
+    for(sb = 0; sb < 32; sb++)
+      IMDCT_Win(&(id->g_main_data.is[gr][ch][sb*18]),rawout,bench_bt);
+}
+
+static void K_Hybrid_Synthesis(pdmp3_handle *id,unsigned gr,unsigned nch){
+  unsigned ch;
+  for(ch = 0; ch < nch; ch++) L3_Hybrid_Synthesis(id,gr,ch);
+}
+
+static void K_Subband_Synthesis(pdmp3_handle *id,unsigned gr,unsigned nch){
+  unsigned ch;
+  for(ch = 0; ch < nch; ch++) L3_Subband_Synthesis(id,gr,ch,bench_pcm);
+}
+/* The paired kernels Decode_L3() uses for stereo granules */
+static void K_Hybrid_Synthesis_Stereo(pdmp3_handle *id,unsigned gr,unsigned nch){
+  if(nch == 2) L3_Hybrid_Synthesis_Stereo(id,gr);
+  else L3_Hybrid_Synthesis(id,gr,0);
+}
+static void K_Subband_Synthesis_Stereo(pdmp3_handle *id,unsigned gr,unsigned nch){
+  if(nch == 2) L3_Subband_Synthesis_Stereo(id,gr,bench_pcm);
+  else L3_Subband_Synthesis(id,gr,0,bench_pcm);
+}
+
+/**Description: times a batch kernel on one lane group filled with copies of
+                the captured granule.
+* Parameters: Kernel name,captured stage,0 for hybrid,1 for subband
+              synthesis,repetitions.
+* Return value: None.
+**/
+static void Bench_Batch(const char *name,unsigned stage,int subband,unsigned repeat){
+  static t_batch_group g;
+  bench_acc a;
+  bench_frame *f;
+  unsigned r,gr,nch,l,i,sb,ch;
+
+  memset(&a,0,sizeof(a));
+  memset(&g,0,sizeof(g));
+  for(r = 0; r < repeat; r++) {
+    for(f = frames; f < frames + nframes; f++) {
+      nch =(f->hdr.mode == mpeg1_mode_single_channel ? 1 : 2);
+      for(gr = 0; gr < 2; gr++) {
+        for(l = 0; l < BATCH_VEC; l++) {
+          ch = l % nch;
+          for(i = 0; i < 576; i++) g.x[i][l] = f->is[stage][gr][ch][i];
+          for(sb = 0; sb < 32; sb++)
+            g.bt[sb][l] =((f->side.win_switch_flag[gr][ch] == 1) &&
+             (f->side.mixed_block_flag[gr][ch] == 1) &&(sb < 2))
+              ? 0 : f->side.block_type[gr][ch];
+        }
+        if(subband) BENCH_TIME(&a,Batch_Subband_Synthesis(&g,g.pcm[gr]));
+        else BENCH_TIME(&a,Batch_Hybrid_Synthesis(&g));
+        a.n += BATCH_VEC/nch - 1; /* Streams per call */
+      }
+    }
+  }
+  Bench_Report(name,&a);
+}
+
+/**Description: times one kernel on the captured input of its stage.
+* Parameters: Stream handle,kernel name,captured stage,kernel,repetitions.
+* Return value: None.
+**/
+static void Bench_Kernel(pdmp3_handle *id,const char *name,unsigned stage,bench_kernel k,unsigned repeat){
+  bench_acc a;
+  bench_frame *f;
+  unsigned r,gr,nch;
+
+  memset(&a,0,sizeof(a));
+  for(r = 0; r < repeat; r++) {
+    for(f = frames; f < frames + nframes; f++) {
+      id->g_frame_header = f->hdr;
+      id->g_side_info = f->side;
+      id->g_main_data = f->main;
+      nch =(f->hdr.mode == mpeg1_mode_single_channel ? 1 : 2);
+      for(gr = 0; gr < 2; gr++) {
+        memcpy(id->g_main_data.is[gr],f->is[stage][gr],sizeof(f->is[0][0]));
+        BENCH_TIME(&a,k(id,gr,nch));
+      }
+    }
+  }
+  Bench_Report(name,&a);
+}
+
+static void Bench_Run(pdmp3_handle *id,unsigned repeat){
+  bench_acc a;
+  bench_frame *f;
+  unsigned r,gr,ch,nch;
+  char name[32];
+
+  printf("kernel,granules,ns_per_granule,tsc_per_granule,cycles_per_granule,ipc,cache_misses_per_granule\n");
+
+  memset(&a,0,sizeof(a));
+  for(r = 0; r < repeat; r++) {
+    for(f = frames; f < frames + nframes; f++) {
+      id->g_frame_header = f->hdr;
+      id->g_side_info = f->side;
+      memcpy(id->g_main_data_vec,f->reservoir,sizeof(f->reservoir));
+      nch =(f->hdr.mode == mpeg1_mode_single_channel ? 1 : 2);
+      for(gr = 0; gr < 2; gr++) {
+        BENCH_TIME(&a,
+          for(ch = 0; ch < nch; ch++) {
+            Set_Main_Pos(id,f->huff_start[gr][ch]);
+            Read_Huffman(id,f->part_2_start[gr][ch],gr,ch);
+          });
+      }
+    }
+  }
+  Bench_Report("huffman_decode",&a);
+
+  Bench_Kernel(id,"l3_requantize",BENCH_IN_REQUANTIZE,K_Requantize,repeat);
+  Bench_Kernel(id,"l3_reorder",BENCH_IN_REORDER,K_Reorder,repeat);
+  Bench_Kernel(id,"l3_stereo",BENCH_IN_STEREO,K_Stereo,repeat);
+  Bench_Kernel(id,"l3_antialias",BENCH_IN_ANTIALIAS,K_Antialias,repeat);
+  Bench_Kernel(id,"l3_spectrum",BENCH_IN_REQUANTIZE,K_Spectrum,repeat);
+  for(bench_bt = 0; bench_bt < 4; bench_bt++) {
+    snprintf(name,sizeof(name),"imdct_win_bt%u",bench_bt);
+    Bench_Kernel(id,name,BENCH_IN_HYBRID,K_IMDCT_Win,repeat);
+  }
+  Bench_Kernel(id,"l3_hybrid_synthesis",BENCH_IN_HYBRID,K_Hybrid_Synthesis,repeat);
+  Bench_Kernel(id,"l3_subband_synthesis",BENCH_IN_SUBBAND,K_Subband_Synthesis,repeat);
+  Bench_Kernel(id,"l3_hybrid_synthesis_stereo",BENCH_IN_HYBRID,K_Hybrid_Synthesis_Stereo,repeat);
+  Bench_Kernel(id,"l3_subband_synthesis_stereo",BENCH_IN_SUBBAND,K_Subband_Synthesis_Stereo,repeat);
+  Bench_Batch("batch_hybrid_synthesis",BENCH_IN_HYBRID,0,repeat);
+  Bench_Batch("batch_subband_synthesis",BENCH_IN_SUBBAND,1,repeat);
+}
+
+/* ISO/IEC 11172-4 decoder accuracy limits,relative to a full scale of 1.0 */
+#define ACC_FULL_RMS     (1.0 / 32768.0 / sqrt(12.0)) /* 2^-15/sqrt(12) */
+#define ACC_FULL_MAX     (1.0 / 16384.0)              /* 2^-14 */
+#define ACC_LIMITED_RMS  (1.0 / 2048.0 / sqrt(12.0))  /* 2^-11/sqrt(12) */
+
+/**Description: compares decoded S16 output against the reference output.
+* Parameters: Label to report,reference and test PCM files,required class.
+* Return value: 0 if the test output meets the required accuracy class.
+**/
+static int Bench_Accuracy(const char *label,const char *ref,const char *test,const char *level){
+  FILE *fr,*ft;
+  short a[4096],b[4096];
+  size_t na,nb,i;
+  uint64_t n = 0;
+  double d,sum = 0.0,max = 0.0,rms;
+  const char *cls;
+  int ok;
+
+  fr = fopen(ref,"rb");
+  ft = fopen(test,"rb");
+  if(fr == NULL || ft == NULL) {
+    perror(fr == NULL ? ref : test);
+    return(1);
+  }
+  do {
+    na = fread(a,sizeof(short),4096,fr);
+    nb = fread(b,sizeof(short),4096,ft);
+    for(i = 0; i < na && i < nb; i++) {
+      d = fabs(((double) a[i] - (double) b[i]) / 32768.0);
+      sum += d * d;
+      if(d > max) max = d;
+    }
+    n += i;
+  } while(na == 4096 && nb == 4096);
+  fclose(fr);
+  fclose(ft);
+
+  rms = n ? sqrt(sum / n) : 0.0;
+  if(na != nb) cls = "length_mismatch";
+  else if((rms < ACC_FULL_RMS) &&(max <= ACC_FULL_MAX)) cls = "full";
+  else if(rms < ACC_LIMITED_RMS) cls = "limited";
+  else cls = "none";
+  ok = !strcmp(cls,"full") || (!strcmp(cls,"limited") && !strcmp(level,"limited"));
+  /* Deviations are reported in 16-bit LSBs */
+  printf("%s,%llu,%.4f,%.0f,%s,%s\n",label,(unsigned long long) n,
+         rms * 32768.0,max * 32768.0,cls,ok ? "pass" : "FAIL");
+  return(!ok);
+}
+
+int main(int ac,char **av){
+  unsigned repeat = BENCH_REPEAT;
+  unsigned char *data;
+  pdmp3_handle *id;
+  struct stat st;
+  FILE *fp;
+  int i = 1;
+
+  if((ac == 6) && !strcmp(av[1],"-a"))
+    return(Bench_Accuracy(av[2],av[3],av[4],av[5]));
+  if((ac > 3) && !strcmp(av[1],"-r")) {
+    repeat = atoi(av[2]);
+    i = 3;
+  }
+  if(i != ac - 1) {
+    fprintf(stderr,"usage: %s [-r repeat] file.mp3\n"
+                   "       %s -a label ref.pcm test.pcm full|limited\n",av[0],av[0]);
+    return(1);
+  }
+  fp = fopen(av[i],"rb");
+  if(fp == NULL || fstat(fileno(fp),&st) != 0) {
+    perror(av[i]);
+    return(1);
+  }
+  data = malloc(st.st_size);
+  frames = malloc(BENCH_MAX_FRAMES * sizeof(bench_frame));
+  id = pdmp3_new(NULL,NULL);
+  if(!data || !frames || !id) Error("Out of memory\n",1);
+  if(fread(data,1,st.st_size,fp) != st.st_size) Error("Unable to read input\n",1);
+  fclose(fp);
+
+  if(Bench_Capture(id,data,st.st_size) == 0) Error("No decodable frames\n",1);
+  Bench_Perf_Open();
+  Bench_Run(id,repeat);
+
+  pdmp3_delete(id);
+  free(frames);
+  free(data);
+  return(0);
+}
@@ -0,0 +1,73 @@
+/*
+ Public Domain (www.unlicense.org)
+ This is free and unencumbered software released into the public domain.
+ Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+ software, either in source code form or as a compiled binary, for any purpose,
+ commercial or non-commercial, and by any means.
+
+ Table generator for pdmp3.c, run on the build host:
+   mktables > pdmp3_tables.h
+
+ Writes the tables the decoder used to compute on first use as static const
+ data, so they end up in read-only pages shared by every process. The values
+ are computed exactly as the decoder computed them and printed with enough
+ digits to give back the same float.
+*/
+#include <stdio.h>
+#include <math.h>
+
+#define C_PI 3.14159265358979323846
+
+/**Description: prints the rows of a float table.
+* Parameters: Values,number of rows,values per row.
+* Return value: None
+**/
+static void Print_Rows(const float *v,unsigned rows,unsigned cols){
+  unsigned r,c;
+
+  for(r = 0; r < rows; r++) {
+    printf(rows > 1 ? "  {" : "  ");
+    for(c = 0; c < cols; c++) {
+      printf("%.9ef%s",v[r*cols + c],(c + 1 < cols) ? "," : "");
+      if((c % 4 == 3) &&(c + 1 < cols)) printf("\n   ");
+    }
+    printf(rows > 1 ? "}%s\n" : "%s\n",(r + 1 < rows) ? "," : "");
+  }
+}
+
+int main(void){
+  static float powtab34[8207],imdct_win[4][36],synth_n_win[64][32];
+  unsigned i,j;
+
+  /* Requantize_Pow_43() */
+  for(i = 0; i < 8207; i++)
+    powtab34[i] = pow((float) i,4.0 / 3.0);
+  /* The four(one for each block type) window vectors of IMDCT_Win() */
+  for(i = 0; i < 36; i++)  imdct_win[0][i] = sin(C_PI/36 *(i + 0.5)); //0
+  for(i = 0; i < 18; i++)  imdct_win[1][i] = sin(C_PI/36 *(i + 0.5)); //1
+  for(i = 18; i < 24; i++) imdct_win[1][i] = 1.0;
+  for(i = 24; i < 30; i++) imdct_win[1][i] = sin(C_PI/12 *(i + 0.5 - 18.0));
+  for(i = 30; i < 36; i++) imdct_win[1][i] = 0.0;
+  for(i = 0; i < 12; i++)  imdct_win[2][i] = sin(C_PI/12 *(i + 0.5)); //2
+  for(i = 12; i < 36; i++) imdct_win[2][i] = 0.0;
+  for(i = 0; i < 6; i++)   imdct_win[3][i] = 0.0; //3
+  for(i = 6; i < 12; i++)  imdct_win[3][i] = sin(C_PI/12 *(i + 0.5 - 6.0));
+  for(i = 12; i < 18; i++) imdct_win[3][i] = 1.0;
+  for(i = 18; i < 36; i++) imdct_win[3][i] = sin(C_PI/36 *(i + 0.5));
+  /* The n_win matrix of the polyphase subband synthesis */
+  for(i = 0; i < 64; i++)
+    for(j = 0; j < 32; j++)
+      synth_n_win[i][j] = cos(((float)(16+i)*(2*j+1)) *(C_PI/64.0));
+
+  printf("/* Generated by mktables.c,do not edit */\n\n");
+  printf("#ifdef POW34_TABLE\nstatic const float g_powtab34[8207] = {\n");
+  Print_Rows(powtab34,1,8207);
+  printf("};\n#endif\n\n");
+  printf("#ifndef IMDCT_TABLES\nstatic const float g_imdct_win[4][36] = {\n");
+  Print_Rows(&imdct_win[0][0],4,36);
+  printf("};\n#endif\n\n");
+  printf("static const float g_synth_n_win[64][32] = {\n");
+  Print_Rows(&synth_n_win[0][0],64,32);
+  printf("};\n");
+  return(0);
+}
@@ -25,6 +25,9 @@
    Erik Hofman (added a subset of the libmpg123 compatible streaming API)
 */
 
+#ifdef OUTPUT_ASYNC
+#define _GNU_SOURCE /* vmsplice(),F_SETPIPE_SZ */
+#endif
 #include <stdint.h>
 #include <stdbool.h>
 #include <unistd.h>
@@ -33,10 +36,30 @@
 #include <stdio.h>
 #include <math.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #ifdef OUTPUT_SOUND
 #include <sys/soundcard.h>
 #endif
+#ifdef OUTPUT_ASYNC
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <poll.h>
+#endif
+#ifdef PDMP3_URING
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#ifdef PDMP3_STAGE_STATS
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#endif
 
 /* Types used in the frame header */
 typedef enum { /* Layer number */
@@ -69,33 +92,33 @@ typedef struct { /* MPEG1 Layer 1-3 frame header */
 }
 t_mpeg1_header;
 typedef struct {  /* MPEG1 Layer 3 Side Information : [2][2] means [gr][ch] */
-  unsigned main_data_begin;         /* 9 bits */
-  unsigned private_bits;            /* 3 bits in mono,5 in stereo */
-  unsigned scfsi[2][4];             /* 1 bit */
-  unsigned part2_3_length[2][2];    /* 12 bits */
-  unsigned big_values[2][2];        /* 9 bits */
-  unsigned global_gain[2][2];       /* 8 bits */
-  unsigned scalefac_compress[2][2]; /* 4 bits */
-  unsigned win_switch_flag[2][2];   /* 1 bit */
+  uint16_t main_data_begin;         /* 9 bits */
+  uint8_t  private_bits;            /* 3 bits in mono,5 in stereo */
+  uint8_t  scfsi[2][4];             /* 1 bit */
+  uint16_t part2_3_length[2][2];    /* 12 bits */
+  uint16_t big_values[2][2];        /* 9 bits */
+  uint8_t  global_gain[2][2];       /* 8 bits */
+  uint8_t  scalefac_compress[2][2]; /* 4 bits */
+  uint8_t  win_switch_flag[2][2];   /* 1 bit */
   /* if(win_switch_flag[][]) */ //use a union dammit
-  unsigned block_type[2][2];        /* 2 bits */
-  unsigned mixed_block_flag[2][2];  /* 1 bit */
-  unsigned table_select[2][2][3];   /* 5 bits */
-  unsigned subblock_gain[2][2][3];  /* 3 bits */
+  uint8_t  block_type[2][2];        /* 2 bits */
+  uint8_t  mixed_block_flag[2][2];  /* 1 bit */
+  uint8_t  table_select[2][2][3];   /* 5 bits */
+  uint8_t  subblock_gain[2][2][3];  /* 3 bits */
   /* else */
   /* table_select[][][] */
-  unsigned region0_count[2][2];     /* 4 bits */
-  unsigned region1_count[2][2];     /* 3 bits */
+  uint8_t  region0_count[2][2];     /* 4 bits */
+  uint8_t  region1_count[2][2];     /* 3 bits */
   /* end */
-  unsigned preflag[2][2];           /* 1 bit */
-  unsigned scalefac_scale[2][2];    /* 1 bit */
-  unsigned count1table_select[2][2];/* 1 bit */
-  unsigned count1[2][2];            /* Not in file,calc. by huff.dec.! */
+  uint8_t  preflag[2][2];           /* 1 bit */
+  uint8_t  scalefac_scale[2][2];    /* 1 bit */
+  uint8_t  count1table_select[2][2];/* 1 bit */
+  uint16_t count1[2][2];            /* Not in file,calc. by huff.dec.! */
 }
 t_mpeg1_side_info;
 typedef struct { /* MPEG1 Layer 3 Main Data */
-  unsigned  scalefac_l[2][2][21];    /* 0-4 bits */
-  unsigned  scalefac_s[2][2][12][3]; /* 0-4 bits */
+  uint8_t   scalefac_l[2][2][22];    /* 0-4 bits,band 21 is always 0 */
+  uint8_t   scalefac_s[2][2][13][3]; /* 0-4 bits,band 12 is always 0 */
   float is[2][2][576];               /* Huffman coded freq. lines */
 }
 t_mpeg1_main_data;
@@ -120,30 +143,109 @@ t_sf_band_indices;
 
 #define PDMP3_ENC_SIGNED_16 (0x080|0x040|0x10)
 
-#define INBUF_SIZE      (4*4096)
+/* Decoder stages timed when compiled with PDMP3_STAGE_STATS */
+typedef enum {
+  PDMP3_STAGE_HEADER = 0, /* Sync search,header and CRC */
+  PDMP3_STAGE_SIDE_INFO,  /* Read_Audio_L3 */
+  PDMP3_STAGE_MAIN_DATA,  /* Bit reservoir and scalefactors */
+  PDMP3_STAGE_HUFFMAN,
+  PDMP3_STAGE_REQUANTIZE,/* With reorder,stereo and antialias,see L3_Spectrum() */
+  PDMP3_STAGE_REORDER,    /* These three stay 0 since the passes are fused */
+  PDMP3_STAGE_STEREO,
+  PDMP3_STAGE_ANTIALIAS,
+  PDMP3_STAGE_HYBRID,     /* IMDCT,windowing,overlap add,freq. inversion */
+  PDMP3_STAGE_SUBBAND,
+  PDMP3_STAGE_NUM
+}
+pdmp3_stage;
+typedef struct {
+  uint64_t frames;                    /* Frames passed to Decode_L3 */
+  uint64_t cycles[PDMP3_STAGE_NUM];   /* TSC ticks on x86,ns elsewhere */
+}
+pdmp3_stage_stats;
+typedef struct { /* Events since pdmp3_open_feed(),see pdmp3_get_stats() */
+  uint64_t frames;         /* Frames decoded */
+  uint64_t underflows;     /* Frames skipped,the bit reservoir lacked data */
+  uint64_t sync_losses;    /* Headers found only after skipping bytes */
+  uint64_t skipped_bytes;  /* Bytes skipped to find them */
+  uint64_t huffman_errors; /* Illegal Huffman code words */
+  uint64_t clipped;        /* Samples clipped to 16 bits */
+  uint64_t feed_no_space;  /* pdmp3_feed() calls that found the buffer full */
+}
+pdmp3_stats;
+
+/* Input ring buffer size per handle,it has to hold a couple of frames.
+ * Lower it with -DPDMP3_INBUF_SIZE=4096 when running many streams at once. */
+#ifndef PDMP3_INBUF_SIZE
+#define PDMP3_INBUF_SIZE (4*4096)
+#endif
+#if PDMP3_INBUF_SIZE < 4096
+#error "PDMP3_INBUF_SIZE must be at least 4096 bytes"
+#endif
+#define INBUF_SIZE      PDMP3_INBUF_SIZE
+/* Headers that have to follow a header found after skipping bytes before it
+ * is taken for a frame and not junk */
+#ifndef PDMP3_RESYNC_FRAMES
+#define PDMP3_RESYNC_FRAMES 2
+#endif
+/* Bit reservoir for main data. A frame reads its main_data_begin(511) bytes
+ * of earlier frames and its own main data(1441 bytes at most). Read_Main_L3()
+ * keeps a corrupt frame within that but for the scalefactors of four granules
+ * (64 bytes),and the bit reader looks 8 bytes ahead. Frames are appended
+ * until the next one would not fit,then the last 511 bytes are moved to the
+ * front. */
+#define RES_SIZE   4096 /* About twice the 511+1441+64+8 bytes a frame needs */
+#define RES_KEEP   511  /* Bytes kept when the reservoir is compacted */
+#define RES_SLACK  (64 + 8)
+/* State that pdmp3_open_feed() only clears when it has been used */
+#define HANDLE_DIRTY_SYNTH    1 /* store[] and v_vec[] */
+#define HANDLE_DIRTY_SCALEFAC 2
 typedef struct
 {
   size_t processed;
-  unsigned istart,iend,ostart;
+  unsigned istart,iend,ostart,olen; /* olen: samples per channel staged */
   unsigned char in[INBUF_SIZE];
-  unsigned out[2][576];
   t_mpeg1_header g_frame_header;
   t_mpeg1_side_info g_side_info;  /* < 100 words */
   t_mpeg1_main_data g_main_data;
 
-  unsigned hsynth_init;
-  unsigned synth_init;
+  unsigned dirty;       /* State pdmp3_open_feed() has to clear,HANDLE_DIRTY_* */
+  unsigned generation;  /* Counts pdmp3_open_feed() calls */
+  float store[32][18][2];  /* Overlap add state,[sb][i][ch] */
+  float v_vec[1024][2];    /* Polyphase synthesis state,[i][ch] */
+  size_t frame_num;        /* Frames read since pdmp3_open_feed() */
+  /* Frame_Ready() scan,kept across calls until input is consumed */
+  size_t frame_pos;        /* processed and istart when the scan began */
+  unsigned frame_istart;
+  unsigned frame_scan;     /* Buffered bytes looked at */
+  unsigned frame_word;     /* The last four of them */
+  unsigned frame_syncs;    /* Sync words among them Search_Header() rejects */
+  unsigned frame_at;       /* Offset of the header found,~0 if none */
+  unsigned frame_need;     /* Bytes its frame needs buffered,0 until settled */
+  int input_end;           /* pdmp3_feed_end() was called */
   /* Bit reservoir for main data */
-  unsigned g_main_data_vec[2*1024];/* Large static data */
-  unsigned *g_main_data_ptr;/* Pointer into the reservoir */
+  unsigned char g_main_data_vec[RES_SIZE];
+  unsigned char *g_main_data_ptr;/* Pointer into the reservoir */
   unsigned g_main_data_idx;/* Index into the current byte(0-7) */
-  unsigned g_main_data_top;/* Number of bytes in reservoir(0-1024) */
+  unsigned g_main_data_top;/* Number of bytes in reservoir(0-1952) */
+  unsigned g_main_data_end;/* Position the next byte goes to(>= RES_KEEP) */
   /* Bit reservoir for side info */
-  unsigned side_info_vec[32+4];
-  unsigned *side_info_ptr;  /* Pointer into the reservoir */
-  unsigned side_info_idx;  /* Index into the current byte(0-7) */
+  unsigned char side_info_vec[32+4];  /* Padded for the last 64 bit load */
 
   char new_header;
+  char granule_output;  /* pdmp3_read() decodes one granule at a time */
+  char granule_next;    /* Granule 1 of the last frame read is still due */
+  void (*release)(void *ctx,void *mem); /* Frees the handle,NULL for caller memory */
+  void *alloc_ctx;
+  void *pool_next;      /* Next free handle in the thread's pool */
+  pdmp3_stats stats;
+#ifdef PDMP3_STAGE_STATS
+  uint64_t stage_mark;
+  pdmp3_stage_stats stage_stats;
+#endif
+#ifdef PDMP3_PIPELINE
+  struct pdmp3_pipeline *pipeline; /* Parse stage running on its own thread */
+#endif
 }
 pdmp3_handle;
 
@@ -151,9 +253,43 @@ pdmp3_handle* pdmp3_new(const char *decoder,int *error);
 void pdmp3_delete(pdmp3_handle *id);
 int pdmp3_open_feed(pdmp3_handle *id);
 int pdmp3_feed(pdmp3_handle *id,const unsigned char *in,size_t size);
+int pdmp3_feed_end(pdmp3_handle *id);
 int pdmp3_read(pdmp3_handle *id,unsigned char *outmemory,size_t outsize,size_t *done);
 int pdmp3_decode(pdmp3_handle *id,const unsigned char *in,size_t insize,unsigned char *out,size_t outsize,size_t *done);
 int pdmp3_getformat(pdmp3_handle *id,long *rate,int *channels,int *encoding);
+int pdmp3_get_stage_stats(pdmp3_handle *id,pdmp3_stage_stats *stats);
+int pdmp3_get_stats(pdmp3_handle *id,pdmp3_stats *stats);
+int pdmp3_set_granule_output(pdmp3_handle *id,int enable);
+int pdmp3_decode_frame(pdmp3_handle *id,off_t *num,unsigned char **audio,size_t *bytes);
+typedef void (*pdmp3_frame_fn)(void *ctx,off_t num,const int16_t *pcm,size_t samples,int channels);
+int pdmp3_decode_frames(pdmp3_handle *id,pdmp3_frame_fn fn,void *ctx);
+int pdmp3_decode_range(pdmp3_handle *id,const unsigned char *mp3,size_t size,off_t start,off_t end,unsigned char *out,size_t outsize,size_t *done);
+int pdmp3_skip_frames(pdmp3_handle *id,unsigned n,unsigned *skipped);
+size_t pdmp3_handle_size(void);
+
+/* Handles in caller memory or from caller allocators */
+#define PDMP3_HANDLE_ALIGN 64 /* A cache line,handles never share one */
+typedef void *(*pdmp3_alloc_fn)(void *ctx,size_t size,size_t align);
+typedef void (*pdmp3_free_fn)(void *ctx,void *mem);
+
+int pdmp3_get_handle_requirements(size_t *size,size_t *align);
+pdmp3_handle *pdmp3_init_handle(void *mem,size_t size,int *error);
+pdmp3_handle *pdmp3_new_with_allocator(pdmp3_alloc_fn alloc,pdmp3_free_fn release,void *ctx,int *error);
+
+/* Per-thread pool of reset handles,for decoding many short clips */
+pdmp3_handle *pdmp3_pool_get(int *error);
+void pdmp3_pool_put(pdmp3_handle *id);
+void pdmp3_pool_drain(void);
+
+/* Lockstep decoding of up to PDMP3_BATCH_MAX streams */
+#define PDMP3_BATCH_MAX    16
+#define PDMP3_BATCH_FRAME  (2*576*2*2) /* Max. bytes decoded per stream */
+typedef struct pdmp3_batch pdmp3_batch;
+
+pdmp3_batch *pdmp3_batch_new(void);
+void pdmp3_batch_delete(pdmp3_batch *b);
+int pdmp3_batch_attach(pdmp3_batch *b,unsigned slot,pdmp3_handle *id);
+int pdmp3_batch_decode(pdmp3_batch *b,unsigned char *out[],size_t done[],int res[]);
 /** end of the subset of a libmpg123 compatible streaming API */
 
 void pdmp3(char * const *mp3s);
@@ -182,6 +318,26 @@ void pdmp3(char * const *mp3s);
 #endif
 
 
+#ifdef PDMP3_STAGE_STATS
+static inline uint64_t Get_Cycles(void){
+#if defined(__x86_64__) || defined(__i386__)
+  return(__rdtsc());
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return((uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec);
+#endif
+}
+/* Charge the time since the last mark to a stage */
+#define STAGE_START(id) ((id)->stage_mark = Get_Cycles())
+#define STAGE_END(id,stage) do { uint64_t t_ = Get_Cycles();          \
+    (id)->stage_stats.cycles[stage] += t_ - (id)->stage_mark;          \
+    (id)->stage_mark = t_; } while(0)
+#else
+#define STAGE_START(id) do{}while(0)
+#define STAGE_END(id,stage) do{}while(0)
+#endif
+
 #ifdef DEBUG //debug functions
 void dmp_fr(t_mpeg1_header *hdr);
 void dmp_si(t_mpeg1_header *hdr,t_mpeg1_side_info *si);
@@ -195,9 +351,11 @@ void dmp_samples(t_mpeg1_main_data *md,int gr,int ch,int type);
 #define dmp_huff(...) do{}while(0)
 #define dmp_samples(...) do{}while(0)
 #endif
-static int Decode_L3(pdmp3_handle *id);
-static int Get_Bytes(pdmp3_handle *id,unsigned no_of_bytes,unsigned data_vec[]);
+static void Decode_L3_Granule(pdmp3_handle *id,unsigned gr,int16_t *pcm);
+static int Decode_L3(pdmp3_handle *id,int16_t *pcm);
+static int Get_Bytes(pdmp3_handle *id,unsigned no_of_bytes,unsigned char data_vec[]);
 static int Get_Main_Data(pdmp3_handle *id,unsigned main_data_size,unsigned main_data_begin);
+static unsigned Put_Main_Data(pdmp3_handle *id,unsigned no_of_bytes);
 static int Huffman_Decode(pdmp3_handle *id,unsigned table_num,int32_t *x,int32_t *y,int32_t *v,int32_t *w);
 static int Read_Audio_L3(pdmp3_handle *id);
 static int Read_CRC(pdmp3_handle *id);
@@ -207,26 +365,35 @@ static int Read_Main_L3(pdmp3_handle *id);
 static int Set_Main_Pos(pdmp3_handle *id,unsigned bit_pos);
 
 static unsigned Get_Inbuf_Filled(pdmp3_handle *id);
+#ifndef PDMP3_PIPELINE /* The parser thread owns the input buffer */
 static unsigned Get_Inbuf_Free(pdmp3_handle *id);
+#endif
 
 static unsigned Get_Byte(pdmp3_handle *id);
 static unsigned Get_Main_Bit(pdmp3_handle *id);
 static unsigned Get_Main_Bits(pdmp3_handle *id,unsigned number_of_bits);
 static unsigned Get_Main_Pos(pdmp3_handle *id);
-static unsigned Get_Side_Bits(pdmp3_handle *id,unsigned number_of_bits);
+static uint64_t Get_Main_Window(pdmp3_handle *id);
+static uint64_t Get_Side_Window(pdmp3_handle *id,unsigned bit_pos);
+static void Skip_Main_Bits(pdmp3_handle *id,unsigned number_of_bits);
 static unsigned Get_Filepos(pdmp3_handle *id);
 
 static void Error(const char *s,int e);
 static void Get_Sideinfo(pdmp3_handle *id,unsigned sideinfo_size);
 static void IMDCT_Win(float in[18],float out[36],unsigned block_type);
+static void IMDCT_Win_Stereo(const float in0[18],const float in1[18],float out[36][2],unsigned block_type);
 static void L3_Antialias(pdmp3_handle *id,unsigned gr,unsigned ch);
 static void L3_Frequency_Inversion(pdmp3_handle *id,unsigned gr,unsigned ch);
 static void L3_Hybrid_Synthesis(pdmp3_handle *id,unsigned gr,unsigned ch);
+static void L3_Hybrid_Synthesis_Stereo(pdmp3_handle *id,unsigned gr);
 static void L3_Requantize(pdmp3_handle *id,unsigned gr,unsigned ch);
 static void L3_Reorder(pdmp3_handle *id,unsigned gr,unsigned ch);
 static void L3_Stereo(pdmp3_handle *id,unsigned gr);
-static void L3_Subband_Synthesis(pdmp3_handle *id,unsigned gr,unsigned ch,unsigned outdata[576]);
+static void L3_Spectrum(pdmp3_handle *id,unsigned gr);
+static void L3_Subband_Synthesis(pdmp3_handle *id,unsigned gr,unsigned ch,int16_t *outdata);
+static void L3_Subband_Synthesis_Stereo(pdmp3_handle *id,unsigned gr,int16_t *outdata);
 static void Read_Huffman(pdmp3_handle *id,unsigned part_2_start,unsigned gr,unsigned ch);
+static void Read_Scalefactors(pdmp3_handle *id,unsigned gr,unsigned ch);
 static void Requantize_Process_Long(pdmp3_handle *id,unsigned gr,unsigned ch,unsigned is_pos,unsigned sfb);
 static void Requantize_Process_Short(pdmp3_handle *id,unsigned gr,unsigned ch,unsigned is_pos,unsigned sfb,unsigned win);
 static void Stereo_Process_Intensity_Long(pdmp3_handle *id,unsigned gr,unsigned sfb);
@@ -532,6 +699,33 @@ mpeg1_scalefac_sizes[16][2 /* slen1,slen2 */] = {
   {2,1},{2,2},{2,3},{3,1},{3,2},{3,3},{4,2},{4,3}
 };
 
+/* Side info in front of the granule records,by number of channels - 1 */
+typedef struct {
+  uint8_t private_bits;  /* Width of private_bits */
+  uint8_t scfsi_pos;     /* Bit offset of scfsi[0][0] */
+  uint8_t granule_pos;   /* Bit offset of the record for gr 0,ch 0 */
+}
+t_side_layout;
+static const t_side_layout g_side_layout[2] = { {5,14,18},{3,12,20} };
+#define SIDE_GRANULE_BITS 59 /* One granule/channel record */
+/* Field of 'len' bits at bit 'off' of a left aligned 64 bit window */
+#define SIDE_FIELD(w,off,len) ((unsigned)(((w) << (off)) >> (64 - (len))))
+
+/* Scalefactor bands read with one slen,in bitstream order */
+typedef struct {
+  uint8_t sfb,count;  /* First band and number of bands,count 0 ends a layout */
+  uint8_t win;        /* Values per band,1 for long and 3 for short bands */
+  uint8_t slen;       /* 0 for slen1,1 for slen2 */
+  uint8_t scfsi;      /* scfsi band that lets granule 1 reuse it,4 if none */
+}
+t_scalefac_group;
+enum { SCF_LONG,SCF_SHORT,SCF_MIXED };
+static const t_scalefac_group g_scalefac_groups[3][5] = {
+  { {0,6,1,0,0},{6,5,1,0,1},{11,5,1,1,2},{16,5,1,1,3},{0,0,0,0,4} },
+  { {0,6,3,0,4},{6,6,3,1,4},{0,0,0,0,4} },
+  { {0,8,1,0,4},{3,3,3,0,4},{6,6,3,1,4},{0,0,0,0,4} }
+};
+
 hufftables g_huffman_main [34] = {
   {NULL                  ,  0, 0 },  /* Table  0 */
   {g_huffman_table       ,  7, 0 },  /* Table  1 */
@@ -573,6 +767,7 @@ static const float // ci[8]={-0.6,-0.535,-0.33,-0.185,-0.095,-0.041,-0.0142,-0.0
   cs[8]={0.857493,0.881742,0.949629,0.983315,0.995518,0.999161,0.999899,0.999993},
   ca[8]={-0.514496,-0.471732,-0.313377,-0.181913,-0.094574,-0.040966,-0.014199,-0.003700},
   is_ratios[6] = {0.000000f,0.267949f,0.577350f,1.000000f,1.732051f,3.732051f},
+  pretab[22] = { 0,0,0,0,0,0,0,0,0,0,0,1,1,1,1,2,2,3,3,3,2,0 },
 #ifdef IMDCT_TABLES
   g_imdct_win[4][36] = {
      {0.043619f,0.130526f,0.216440f,0.300706f,0.382683f,0.461749f,
@@ -729,7 +924,7 @@ static const float // ci[8]={-0.6,-0.535,-0.33,-0.185,-0.095,-0.041,-0.0142,-0.0
    }},
 #endif
 #ifdef POW34_ITERATE
-  static const float powtab34[32] = {
+  powtab34[32] = {
   0.000000f,1.000000f,2.519842f,4.326749f,6.349605f,8.549880f,10.902724f,
   13.390519f,16.000001f,18.720756f,21.544349f,24.463783f,27.473145f,30.567354f,
   33.741995f,36.993185f,40.317478f,43.711792f,47.173351f,50.699637f,54.288359f,
@@ -869,6 +1064,9 @@ static const float // ci[8]={-0.6,-0.535,-0.33,-0.185,-0.095,-0.041,-0.0142,-0.0
 //},g_synth_n_win[64][32]={
 };
 
+/* g_powtab34[],g_imdct_win[] and g_synth_n_win[],written by mktables.c */
+#include "pdmp3_tables.h"
+
 
 /* Scale factor band indices
  *
@@ -970,22 +1168,13 @@ static void dmp_samples(t_mpeg1_main_data *md,int gr,int ch,int type){
 * Author: Krister Lagerström(krister@kmlager.com) **/
 static inline float Requantize_Pow_43(unsigned is_pos){
 #ifdef POW34_TABLE
-  static float powtab34[8207];
-  static int init = 0;
-  int i;
-
-  if(init == 0) {   /* First time initialization */
-    for(i = 0; i < 8207; i++)
-      powtab34[i] = pow((float) i,4.0 / 3.0);
-    init = 1;
-  }
 #ifdef DEBUG
   if(is_pos > 8206) {
     ERR("is_pos = %d larger than 8206!",is_pos);
     is_pos = 8206;
   }
 #endif /* DEBUG */
-  return(powtab34[is_pos]);  /* Done */
+  return(g_powtab34[is_pos]);  /* Done */
 #elif defined POW34_ITERATE
   float a4,a2,x,x2,x3,x_next,is_f1,is_f2,is_f3;
   unsigned i;
@@ -1017,45 +1206,73 @@ return powf((float)is_pos,4.0f / 3.0f);
 #endif /* POW34_TABLE || POW34_ITERATE */
 }
 
-/**Description: decodes a layer 3 bitstream into audio samples.
-* Parameters: Stream handle,outdata vector.
-* Return value: PDMP3_OK or PDMP3_ERR if the frame contains errors.
+/**Description: decodes one granule of a layer 3 frame into audio samples.
+* Parameters: Stream handle,granule(0 or 1),outdata vector for 576 interleaved
+              samples per channel.
+* Return value: None
 * Author: Krister Lagerström(krister@kmlager.com) **/
-static int Decode_L3(pdmp3_handle *id){
-  unsigned gr,ch,nch;
+static void Decode_L3_Granule(pdmp3_handle *id,unsigned gr,int16_t *pcm){
+  unsigned ch,nch;
 
   /* Number of channels(1 for mono and 2 for stereo) */
   nch =(id->g_frame_header.mode == mpeg1_mode_single_channel ? 1 : 2);
-  for(gr = 0; gr < 2; gr++) {
-    for(ch = 0; ch < nch; ch++) {
-      dmp_scf(&id->g_side_info,&id->g_main_data,gr,ch); //noop unless debug
-      dmp_huff(&id->g_main_data,gr,ch); //noop unless debug
-      L3_Requantize(id,gr,ch); /* Requantize samples */
-      dmp_samples(&id->g_main_data,gr,ch,0); //noop unless debug
-      L3_Reorder(id,gr,ch); /* Reorder short blocks */
-    } /* end for(ch... */
-    L3_Stereo(id,gr); /* Stereo processing */
-    dmp_samples(&id->g_main_data,gr,0,1); //noop unless debug
-    dmp_samples(&id->g_main_data,gr,1,1); //noop unless debug
-    for(ch = 0; ch < nch; ch++) {
-      L3_Antialias(id,gr,ch); /* Antialias */
-      dmp_samples(&id->g_main_data,gr,ch,2); //noop unless debug
-      L3_Hybrid_Synthesis(id,gr,ch); /*(IMDCT,windowing,overlapp add) */
-      L3_Frequency_Inversion(id,gr,ch); /* Frequency inversion */
-     dmp_samples(&id->g_main_data,gr,ch,3); //noop unless debug
-      L3_Subband_Synthesis(id,gr,ch,id->out[gr]); /* Polyphase subband synthesis */
-    } /* end for(ch... */
+  if(gr == 0) id->stats.frames++;
+#ifdef PDMP3_STAGE_STATS
+  if(gr == 0) id->stage_stats.frames++;
+#endif
+  id->dirty |= HANDLE_DIRTY_SYNTH;
+  STAGE_START(id);
+  for(ch = 0; ch < nch; ch++) {
+    dmp_scf(&id->g_side_info,&id->g_main_data,gr,ch); //noop unless debug
+    dmp_huff(&id->g_main_data,gr,ch); //noop unless debug
+  } /* end for(ch... */
+  /* Requantize,reorder short blocks,stereo processing and antialias */
+  L3_Spectrum(id,gr);
+  STAGE_END(id,PDMP3_STAGE_REQUANTIZE);
+  if(nch == 2) { /* Both channels share the table loads */
+    dmp_samples(&id->g_main_data,gr,0,2); //noop unless debug
+    dmp_samples(&id->g_main_data,gr,1,2); //noop unless debug
+    L3_Hybrid_Synthesis_Stereo(id,gr);
+    L3_Frequency_Inversion(id,gr,0);
+    L3_Frequency_Inversion(id,gr,1);
+    STAGE_END(id,PDMP3_STAGE_HYBRID);
+    dmp_samples(&id->g_main_data,gr,0,3); //noop unless debug
+    dmp_samples(&id->g_main_data,gr,1,3); //noop unless debug
+    L3_Subband_Synthesis_Stereo(id,gr,pcm);
+    STAGE_END(id,PDMP3_STAGE_SUBBAND);
+  }else{
+    dmp_samples(&id->g_main_data,gr,0,2); //noop unless debug
+    L3_Hybrid_Synthesis(id,gr,0); /*(IMDCT,windowing,overlapp add) */
+    L3_Frequency_Inversion(id,gr,0); /* Frequency inversion */
+    STAGE_END(id,PDMP3_STAGE_HYBRID);
+    dmp_samples(&id->g_main_data,gr,0,3); //noop unless debug
+    L3_Subband_Synthesis(id,gr,0,pcm); /* Polyphase subband synthesis */
+    STAGE_END(id,PDMP3_STAGE_SUBBAND);
+  }
 #ifdef DEBUG
-    {
-      int i,ctr = 0;
-      printf("PCM:\n");
-      for(i = 0; i < 576; i++) {
-        printf("%d: %d\n",ctr++,(out[i] >> 16) & 0xffff);
-        if(nch == 2) printf("%d: %d\n",ctr++,out[i] & 0xffff);
-      }
+  {
+    int i,ctr = 0;
+    printf("PCM:\n");
+    for(i = 0; i < 576; i++) {
+      printf("%d: %d\n",ctr++,pcm[i*nch]);
+      if(nch == 2) printf("%d: %d\n",ctr++,pcm[i*nch + 1]);
     }
+  }
 #endif /* DEBUG */
-  } /* end for(gr... */
+}
+
+/**Description: decodes a layer 3 bitstream into audio samples.
+* Parameters: Stream handle,outdata vector for 2*576 interleaved samples per
+              channel.
+* Return value: PDMP3_OK or PDMP3_ERR if the frame contains errors.
+* Author: Krister Lagerström(krister@kmlager.com) **/
+static int Decode_L3(pdmp3_handle *id,int16_t *pcm){
+  unsigned nch;
+
+  /* Number of channels(1 for mono and 2 for stereo) */
+  nch =(id->g_frame_header.mode == mpeg1_mode_single_channel ? 1 : 2);
+  Decode_L3_Granule(id,0,pcm);
+  Decode_L3_Granule(id,1,&pcm[576*nch]);
   return(PDMP3_OK);   /* Done */
 }
 
@@ -1063,9 +1280,11 @@ static unsigned Get_Inbuf_Filled(pdmp3_handle *id) {
   return (id->istart<=id->iend)?(id->iend-id->istart):(INBUF_SIZE-id->istart+id->iend);
 }
 
+#ifndef PDMP3_PIPELINE
 static unsigned Get_Inbuf_Free(pdmp3_handle *id) {
   return  (id->iend<id->istart)?(id->istart-id->iend):(INBUF_SIZE-id->iend+id->istart);
 }
+#endif
 
 
 /** Description: reads 'no_of_bytes' from input stream into 'data_vec[]'.
@@ -1073,7 +1292,7 @@ static unsigned Get_Inbuf_Free(pdmp3_handle *id) {
                 store them.
 *   Return value: PDMP3_OK or PDMP3_ERR if the operation couldn't be performed.
 *   Author: Krister Lagerström(krister@kmlager.com) **/
-static int Get_Bytes(pdmp3_handle *id,unsigned no_of_bytes,unsigned data_vec[]){
+static int Get_Bytes(pdmp3_handle *id,unsigned no_of_bytes,unsigned char data_vec[]){
   int i;
   unsigned val;
 
@@ -1085,6 +1304,37 @@ static int Get_Bytes(pdmp3_handle *id,unsigned no_of_bytes,unsigned data_vec[]){
   return(PDMP3_OK);
 }
 
+/**Description: appends bytes from the input buffer to the bit reservoir,a
+                memcpy() per contiguous piece. When they would not fit with
+                RES_SLACK bytes after them,the last RES_KEEP bytes are first
+                moved to the front.
+* Parameters: Stream handle,number of bytes(fewer are taken if fewer are
+              buffered).
+* Return value: Reservoir position of the first byte appended.
+**/
+static unsigned Put_Main_Data(pdmp3_handle *id,unsigned no_of_bytes){
+  unsigned char *vec = id->g_main_data_vec;
+  unsigned n,pos,end = id->g_main_data_end,filled = Get_Inbuf_Filled(id);
+
+  if(no_of_bytes > filled) no_of_bytes = filled;
+  if(end + no_of_bytes + RES_SLACK > RES_SIZE) {
+    memmove(vec,&vec[end - RES_KEEP],RES_KEEP);
+    end = RES_KEEP;
+  }
+  pos = end;
+  while(no_of_bytes) {
+    n = no_of_bytes;
+    if(n > INBUF_SIZE - id->istart) n = INBUF_SIZE - id->istart;
+    memcpy(&vec[end],&id->in[id->istart],n);
+    id->istart =(id->istart + n) % INBUF_SIZE;
+    id->processed += n;
+    end += n;
+    no_of_bytes -= n;
+  }
+  id->g_main_data_end = end;
+  return(pos);
+}
+
 /** Description: This function assembles the main data buffer with data from
 *              this frame and the previous two frames into a local buffer
 *              used by the Get_Main_Bits function.
@@ -1094,7 +1344,7 @@ static int Get_Bytes(pdmp3_handle *id,unsigned no_of_bytes,unsigned data_vec[]){
 * Return value: Status
 * Author: Krister Lagerström(krister@kmlager.com) **/
 static int Get_Main_Data(pdmp3_handle *id,unsigned main_data_size,unsigned main_data_begin){
-  int i;
+  unsigned start;
 
   if(main_data_size > 1500) ERR("main_data_size = %d\n",main_data_size);
   /* Check that there's data available from previous frames if needed */
@@ -1102,22 +1352,20 @@ static int Get_Main_Data(pdmp3_handle *id,unsigned main_data_size,unsigned main_
     /* No,there is not,so we skip decoding this frame,but we have to
      * read the main_data bits from the bitstream in case they are needed
      * for decoding the next frame. */
-   (void) Get_Bytes(id,main_data_size,&(id->g_main_data_vec[id->g_main_data_top]));
-    /* Set up pointers */
-    id->g_main_data_ptr = &(id->g_main_data_vec[0]);
-    id->g_main_data_idx = 0;
+    Put_Main_Data(id,main_data_size);
     id->g_main_data_top += main_data_size;
+    id->stats.underflows++;
     return(PDMP3_NEED_MORE);    /* This frame cannot be decoded! */
   }
-  for(i = 0; i < main_data_begin; i++) {  /* Copy data from previous frames */
-    id->g_main_data_vec[i] = id->g_main_data_vec[id->g_main_data_top - main_data_begin + i];
-  }
-  /* Read the main_data from file */
- (void) Get_Bytes(id,main_data_size,&(id->g_main_data_vec[main_data_begin]));
+  /* The bytes of previous frames stay where they are,this frame's main
+   * data goes right after them */
+  start = Put_Main_Data(id,main_data_size) - main_data_begin;
   /* Set up pointers */
-  id->g_main_data_ptr = &(id->g_main_data_vec[0]);
+  id->g_main_data_ptr = &(id->g_main_data_vec[start]);
   id->g_main_data_idx = 0;
-  id->g_main_data_top = main_data_begin + main_data_size;
+  /* Only the last 511 bytes(the largest main_data_begin)can be used again */
+  id->g_main_data_top =((id->g_main_data_top < 511) ? id->g_main_data_top : 511) +
+    main_data_size;
   return(PDMP3_OK);  /* Done */
 }
 
@@ -1127,7 +1375,9 @@ static int Get_Main_Data(pdmp3_handle *id,unsigned main_data_size,unsigned main_
 * Return value: PDMP3_OK or PDMP3_ERR if data could not be read,or contains errors.
 * Author: Krister Lagerström(krister@kmlager.com) **/
 static int Read_Audio_L3(pdmp3_handle *id){
-  unsigned framesize,sideinfo_size,main_data_size,nch,ch,gr,scfsi_band,region,window;
+  unsigned framesize,sideinfo_size,main_data_size,nch,ch,gr,scfsi_band,region,window,pos;
+  const t_side_layout *layout;
+  uint64_t w;
 
   /* Number of channels(1 for mono and 2 for stereo) */
   nch =(id->g_frame_header.mode == mpeg1_mode_single_channel ? 1 : 2);
@@ -1149,35 +1399,41 @@ static int Read_Audio_L3(pdmp3_handle *id){
   /* DBG("framesize      =   %d\n",framesize); */
   /* DBG("sideinfo_size  =   %d\n",sideinfo_size); */
   /* DBG("main_data_size =   %d\n",main_data_size); */
-  /* Read sideinfo from bitstream into buffer used by Get_Side_Bits() */
+  /* Read sideinfo from bitstream into the buffer parsed below */
   Get_Sideinfo(id,sideinfo_size);
   if(Get_Filepos(id) == C_EOF) return(PDMP3_ERR);
-  /* Parse audio data */
+  /* Parse audio data. The fields in front of the granule records depend
+   * only on the number of channels,each granule record is one 64 bit load. */
+  layout = &g_side_layout[nch - 1];
+  w = Get_Side_Window(id,0);
   /* Pointer to where we should start reading main data */
-  id->g_side_info.main_data_begin = Get_Side_Bits(id,9);
+  id->g_side_info.main_data_begin = SIDE_FIELD(w,0,9);
   /* Get private bits. Not used for anything. */
-  if(id->g_frame_header.mode == mpeg1_mode_single_channel)
-    id->g_side_info.private_bits = Get_Side_Bits(id,5);
-  else id->g_side_info.private_bits = Get_Side_Bits(id,3);
+  id->g_side_info.private_bits = SIDE_FIELD(w,9,layout->private_bits);
   /* Get scale factor selection information */
   for(ch = 0; ch < nch; ch++)
     for(scfsi_band = 0; scfsi_band < 4; scfsi_band++)
-      id->g_side_info.scfsi[ch][scfsi_band] = Get_Side_Bits(id,1);
+      id->g_side_info.scfsi[ch][scfsi_band] =
+        SIDE_FIELD(w,layout->scfsi_pos + 4*ch + scfsi_band,1);
   /* Get the rest of the side information */
+  pos = layout->granule_pos;
   for(gr = 0; gr < 2; gr++) {
-    for(ch = 0; ch < nch; ch++) {
-      id->g_side_info.part2_3_length[gr][ch]    = Get_Side_Bits(id,12);
-      id->g_side_info.big_values[gr][ch]        = Get_Side_Bits(id,9);
-      id->g_side_info.global_gain[gr][ch]       = Get_Side_Bits(id,8);
-      id->g_side_info.scalefac_compress[gr][ch] = Get_Side_Bits(id,4);
-      id->g_side_info.win_switch_flag[gr][ch]   = Get_Side_Bits(id,1);
+    for(ch = 0; ch < nch; ch++,pos += SIDE_GRANULE_BITS) {
+      w = Get_Side_Window(id,pos);
+      id->g_side_info.part2_3_length[gr][ch]    = SIDE_FIELD(w,0,12);
+      id->g_side_info.big_values[gr][ch]        = SIDE_FIELD(w,12,9);
+      if(id->g_side_info.big_values[gr][ch] > 288) /* Corrupt,keep to 576 lines */
+        id->g_side_info.big_values[gr][ch] = 288;
+      id->g_side_info.global_gain[gr][ch]       = SIDE_FIELD(w,21,8);
+      id->g_side_info.scalefac_compress[gr][ch] = SIDE_FIELD(w,29,4);
+      id->g_side_info.win_switch_flag[gr][ch]   = SIDE_FIELD(w,33,1);
       if(id->g_side_info.win_switch_flag[gr][ch] == 1) {
-        id->g_side_info.block_type[gr][ch]       = Get_Side_Bits(id,2);
-        id->g_side_info.mixed_block_flag[gr][ch] = Get_Side_Bits(id,1);
+        id->g_side_info.block_type[gr][ch]       = SIDE_FIELD(w,34,2);
+        id->g_side_info.mixed_block_flag[gr][ch] = SIDE_FIELD(w,36,1);
         for(region = 0; region < 2; region++)
-          id->g_side_info.table_select[gr][ch][region] = Get_Side_Bits(id,5);
+          id->g_side_info.table_select[gr][ch][region] = SIDE_FIELD(w,37 + 5*region,5);
         for(window = 0; window < 3; window++)
-          id->g_side_info.subblock_gain[gr][ch][window] = Get_Side_Bits(id,3);
+          id->g_side_info.subblock_gain[gr][ch][window] = SIDE_FIELD(w,47 + 3*window,3);
         if((id->g_side_info.block_type[gr][ch]==2)&&(id->g_side_info.mixed_block_flag[gr][ch]==0))
           id->g_side_info.region0_count[gr][ch] = 8; /* Implicit */
         else id->g_side_info.region0_count[gr][ch] = 7; /* Implicit */
@@ -1185,14 +1441,14 @@ static int Read_Audio_L3(pdmp3_handle *id){
         id->g_side_info.region1_count[gr][ch] = 20 - id->g_side_info.region0_count[gr][ch];
      }else{
        for(region = 0; region < 3; region++)
-         id->g_side_info.table_select[gr][ch][region] = Get_Side_Bits(id,5);
-       id->g_side_info.region0_count[gr][ch] = Get_Side_Bits(id,4);
-       id->g_side_info.region1_count[gr][ch] = Get_Side_Bits(id,3);
+         id->g_side_info.table_select[gr][ch][region] = SIDE_FIELD(w,34 + 5*region,5);
+       id->g_side_info.region0_count[gr][ch] = SIDE_FIELD(w,49,4);
+       id->g_side_info.region1_count[gr][ch] = SIDE_FIELD(w,53,3);
        id->g_side_info.block_type[gr][ch] = 0;  /* Implicit */
       }  /* end if ... */
-      id->g_side_info.preflag[gr][ch]            = Get_Side_Bits(id,1);
-      id->g_side_info.scalefac_scale[gr][ch]     = Get_Side_Bits(id,1);
-      id->g_side_info.count1table_select[gr][ch] = Get_Side_Bits(id,1);
+      id->g_side_info.preflag[gr][ch]            = SIDE_FIELD(w,56,1);
+      id->g_side_info.scalefac_scale[gr][ch]     = SIDE_FIELD(w,57,1);
+      id->g_side_info.count1table_select[gr][ch] = SIDE_FIELD(w,58,1);
     } /* end for(channel... */
   } /* end for(granule... */
   return(PDMP3_OK);/* Done */
@@ -1215,6 +1471,7 @@ static int Read_CRC(pdmp3_handle *id){
 * Return value: PDMP3_OK if a frame is successfully read,PDMP3_ERR otherwise.
 * Author: Krister Lagerström(krister@kmlager.com) **/
 static int Read_Frame(pdmp3_handle *id){
+  STAGE_START(id);
   /* Try to find the next frame in the bitstream and decode it */
   if(Search_Header(id) != PDMP3_OK) return(PDMP3_ERR);
 #ifdef DEBUG
@@ -1229,8 +1486,10 @@ static int Read_Frame(pdmp3_handle *id){
 #endif
   /* Get CRC word if present */
   if((id->g_frame_header.protection_bit==0)&&(Read_CRC(id)!=PDMP3_OK)) return(PDMP3_ERR);
+  STAGE_END(id,PDMP3_STAGE_HEADER);
   if(id->g_frame_header.layer == 3) {  /* Get audio data */
     Read_Audio_L3(id);  /* Get side info */
+    STAGE_END(id,PDMP3_STAGE_SIDE_INFO);
     dmp_si(&id->g_frame_header,&id->g_side_info); /* DEBUG */
     /* If there's not enough main data in the bit reservoir,
      * signal to calling function so that decoding isn't done! */
@@ -1319,22 +1578,88 @@ static int Read_Header(pdmp3_handle *id) {
   return(PDMP3_OK);  /* Done */
 }
 
+/**Description: gives the size of the frame a header word starts.
+* Parameters: The four header bytes,first byte in the high bits.
+* Return value: Frame size in bytes,or 0 if it is no MPEG1 layer 3 header.
+**/
+static unsigned Header_Frame_Size(unsigned header){
+  if(((header & 0xfffe0000) != 0xfffa0000) ||(((header >> 12) & 15) == 0) ||
+     (((header >> 12) & 15) == 15) ||(((header >> 10) & 3) == 3)) return(0);
+  return((144 * g_mpeg1_bitrates[2][(header >> 12) & 15]) /
+         g_sampling_frequency[(header >> 10) & 3] +((header >> 9) & 1));
+}
+
+/**Description: checks that the header at an input buffer position is
+                followed by PDMP3_RESYNC_FRAMES headers of the same layer and
+                sampling frequency,each where the frame size of the one
+                before puts it. Headers that aren't buffered yet only count
+                as confirming it once pdmp3_feed_end() was called,or if the
+                input buffer can't hold them,so the outcome doesn't depend
+                on how the stream was split into feeds.
+* Parameters: Stream handle,input buffer position the buffered data starts
+              at,input buffer position of a valid header.
+* Return value: PDMP3_OK,PDMP3_NEED_MORE if no header disproved it but not
+                all are buffered yet,or PDMP3_ERR for a false sync.
+**/
+static int Check_Frame_Chain(pdmp3_handle *id,unsigned start,unsigned pos){
+  unsigned filled =(id->iend + INBUF_SIZE - pos) % INBUF_SIZE;
+  unsigned room = INBUF_SIZE - 1 -(pos + INBUF_SIZE - start) % INBUF_SIZE;
+  unsigned header = 0,next,off = 0,n,i;
+
+  for(i = 0; i < 4; i++) header =(header << 8) | id->in[(pos + i) % INBUF_SIZE];
+  for(n = 0; n < PDMP3_RESYNC_FRAMES; n++) {
+    off += Header_Frame_Size(header);
+    if(off + 4 > filled) /* Not buffered yet */
+      return((id->input_end ||(off + 4 > room)) ? PDMP3_OK : PDMP3_NEED_MORE);
+    for(next = 0,i = 0; i < 4; i++)
+      next =(next << 8) | id->in[(pos + off + i) % INBUF_SIZE];
+    if(!Header_Frame_Size(next) ||((next ^ header) & 0x00000c00)) return(PDMP3_ERR);
+    header = next;
+  }
+  return(PDMP3_OK);
+}
+
+/**Description: finds the next frame header. A header found after skipping
+                bytes only counts if Check_Frame_Chain() confirms it.
+* Parameters: Stream handle.
+* Return value: PDMP3_OK,PDMP3_NEW_FORMAT,PDMP3_NEED_MORE or PDMP3_ERR if no
+                header was found among 2*576 sync words or in the buffered
+                data.
+**/
 static int Search_Header(pdmp3_handle *id) {
   unsigned pos = id->processed;
+  unsigned start = id->istart;
   unsigned mark = id->istart;
+  unsigned hdr,skipped;
   int res = PDMP3_NEED_MORE;
   int cnt = 0;
   while(Get_Inbuf_Filled(id) > 4) {
     res = Read_Header(id);
+    hdr =(id->istart + INBUF_SIZE - 4) % INBUF_SIZE;
+    if((id->in[hdr] != 0xff) ||(id->in[(hdr + 1) % INBUF_SIZE] < 0xf0))
+      break; /* No sync word in the rest of the buffered data */
     if (id->g_frame_header.layer == 3) {
-      if(res == PDMP3_OK || res == PDMP3_NEW_FORMAT) break;
+      if(res == PDMP3_OK || res == PDMP3_NEW_FORMAT) {
+        skipped =(hdr + INBUF_SIZE - start) % INBUF_SIZE;
+        if(skipped == 0) break; /* Where the last frame ended,or the stream starts */
+        if(Check_Frame_Chain(id,start,hdr) == PDMP3_OK) {
+          if(skipped) {
+            ERR("Skipped %u bytes to the frame at file pos %u\n",skipped,pos + skipped);
+            id->stats.sync_losses++;
+            id->stats.skipped_bytes += skipped;
+          }
+          break;
+        }
+        res = PDMP3_ERR;
+      }
     }
+    mark = hdr; /* Not a header,go on after the first byte of its sync word */
     if (++mark == INBUF_SIZE) {
       mark = 0;
     }
     id->istart = mark;
     id->processed = pos;
-    if (++cnt > (2*576)) return(PDMP3_ERR); /* more than one frame and still no header */
+    if (++cnt > (2*576)) return(PDMP3_ERR); /* 2*576 sync words and still no header */
   }
   return res;
 }
@@ -1344,7 +1669,7 @@ static int Search_Header(pdmp3_handle *id) {
 * Return value: PDMP3_OK or PDMP3_ERR if the data contains errors.
 * Author: Krister Lagerström(krister@kmlager.com) **/
 static int Read_Main_L3(pdmp3_handle *id){
-  unsigned framesize,sideinfo_size,main_data_size,gr,ch,nch,sfb,win,slen1,slen2,nbits,part_2_start;
+  unsigned framesize,sideinfo_size,main_data_size,gr,ch,nch,win,part_2_start,end;
   int res;
 
   /* Number of channels(1 for mono and 2 for stereo) */
@@ -1372,75 +1697,82 @@ static int Read_Main_L3(pdmp3_handle *id){
    * Get_Main_Bits function in the same way as the side info is.
    */
   res = Get_Main_Data(id,main_data_size,id->g_side_info.main_data_begin);
+  STAGE_END(id,PDMP3_STAGE_MAIN_DATA);
   if(res != PDMP3_OK) return(res); /* This could be due to not enough data in reservoir */
+  id->dirty |= HANDLE_DIRTY_SCALEFAC;
+  end = Get_Main_Pos(id) +(id->g_side_info.main_data_begin + main_data_size)*8;
   for(gr = 0; gr < 2; gr++) {
     for(ch = 0; ch < nch; ch++) {
       part_2_start = Get_Main_Pos(id);
-      /* Number of bits in the bitstream for the bands */
-      slen1 = mpeg1_scalefac_sizes[id->g_side_info.scalefac_compress[gr][ch]][0];
-      slen2 = mpeg1_scalefac_sizes[id->g_side_info.scalefac_compress[gr][ch]][1];
-      if((id->g_side_info.win_switch_flag[gr][ch] != 0)&&(id->g_side_info.block_type[gr][ch] == 2)) {
-        if(id->g_side_info.mixed_block_flag[gr][ch] != 0) {
-          for(sfb = 0; sfb < 8; sfb++)
-            id->g_main_data.scalefac_l[gr][ch][sfb] = Get_Main_Bits(id,slen1);
-          for(sfb = 3; sfb < 12; sfb++) {
-            nbits = (sfb < 6)?slen1:slen2;/*slen1 for band 3-5,slen2 for 6-11*/
-            for(win = 0; win < 3; win++)
-              id->g_main_data.scalefac_s[gr][ch][sfb][win]=Get_Main_Bits(id,nbits);
-          }
-        }else{
-          for(sfb = 0; sfb < 12; sfb++){
-            nbits = (sfb < 6)?slen1:slen2;/*slen1 for band 3-5,slen2 for 6-11*/
-            for(win = 0; win < 3; win++)
-              id->g_main_data.scalefac_s[gr][ch][sfb][win]=Get_Main_Bits(id,nbits);
-          }
-        }
-      }else{ /* block_type == 0 if winswitch == 0 */
-        /* Scale factor bands 0-5 */
-        if((id->g_side_info.scfsi[ch][0] == 0) ||(gr == 0)) {
-          for(sfb = 0; sfb < 6; sfb++)
-            id->g_main_data.scalefac_l[gr][ch][sfb] = Get_Main_Bits(id,slen1);
-        }else if((id->g_side_info.scfsi[ch][0] == 1) &&(gr == 1)) {
-          /* Copy scalefactors from granule 0 to granule 1 */
-          for(sfb = 0; sfb < 6; sfb++)
-            id->g_main_data.scalefac_l[1][ch][sfb]=id->g_main_data.scalefac_l[0][ch][sfb];
-        }
-        /* Scale factor bands 6-10 */
-        if((id->g_side_info.scfsi[ch][1] == 0) ||(gr == 0)) {
-          for(sfb = 6; sfb < 11; sfb++)
-            id->g_main_data.scalefac_l[gr][ch][sfb] = Get_Main_Bits(id,slen1);
-        }else if((id->g_side_info.scfsi[ch][1] == 1) &&(gr == 1)) {
-          /* Copy scalefactors from granule 0 to granule 1 */
-          for(sfb = 6; sfb < 11; sfb++)
-            id->g_main_data.scalefac_l[1][ch][sfb]=id->g_main_data.scalefac_l[0][ch][sfb];
-        }
-        /* Scale factor bands 11-15 */
-        if((id->g_side_info.scfsi[ch][2] == 0) ||(gr == 0)) {
-          for(sfb = 11; sfb < 16; sfb++)
-            id->g_main_data.scalefac_l[gr][ch][sfb] = Get_Main_Bits(id,slen2);
-        } else if((id->g_side_info.scfsi[ch][2] == 1) &&(gr == 1)) {
-          /* Copy scalefactors from granule 0 to granule 1 */
-          for(sfb = 11; sfb < 16; sfb++)
-            id->g_main_data.scalefac_l[1][ch][sfb]=id->g_main_data.scalefac_l[0][ch][sfb];
-        }
-        /* Scale factor bands 16-20 */
-        if((id->g_side_info.scfsi[ch][3] == 0) ||(gr == 0)) {
-          for(sfb = 16; sfb < 21; sfb++)
-            id->g_main_data.scalefac_l[gr][ch][sfb] = Get_Main_Bits(id,slen2);
-        }else if((id->g_side_info.scfsi[ch][3] == 1) &&(gr == 1)) {
-          /* Copy scalefactors from granule 0 to granule 1 */
-          for(sfb = 16; sfb < 21; sfb++)
-            id->g_main_data.scalefac_l[1][ch][sfb]=id->g_main_data.scalefac_l[0][ch][sfb];
-        }
-      }
+      /* A corrupt part2_3_length would read past the main data */
+      if(part_2_start + id->g_side_info.part2_3_length[gr][ch] > end)
+        id->g_side_info.part2_3_length[gr][ch] =(part_2_start < end) ? end - part_2_start : 0;
+      /* The last band has no scalefactor but is requantized like the others */
+      id->g_main_data.scalefac_l[gr][ch][21] = 0;
+      for(win = 0; win < 3; win++) id->g_main_data.scalefac_s[gr][ch][12][win] = 0;
+      Read_Scalefactors(id,gr,ch);
+      STAGE_END(id,PDMP3_STAGE_MAIN_DATA);
       /* Read Huffman coded data. Skip stuffing bits. */
       Read_Huffman(id,part_2_start,gr,ch);
+      STAGE_END(id,PDMP3_STAGE_HUFFMAN);
     } /* end for(gr... */
   } /* end for(ch... */
   /* The ancillary data is stored here,but we ignore it. */
   return(PDMP3_OK);  /* Done */
 }
 
+/**Description: reads the scalefactors of one granule and channel,following
+*  the band groups of its block layout in g_scalefac_groups. Values are taken
+*  from a 64 bit window of the main data that is reloaded only when it runs
+*  out,instead of one Get_Main_Bits() call per band.
+* Parameters: Stream handle,granule,channel.
+* Return value: None
+**/
+static void Read_Scalefactors(pdmp3_handle *id,unsigned gr,unsigned ch){
+  const t_scalefac_group *g;
+  unsigned slen[2],nbits,n,i,avail,used;
+  uint8_t *dst;
+  uint64_t w;
+
+  /* Number of bits in the bitstream for the bands */
+  slen[0] = mpeg1_scalefac_sizes[id->g_side_info.scalefac_compress[gr][ch]][0];
+  slen[1] = mpeg1_scalefac_sizes[id->g_side_info.scalefac_compress[gr][ch]][1];
+  if((id->g_side_info.win_switch_flag[gr][ch] != 0)&&(id->g_side_info.block_type[gr][ch] == 2))
+    g = g_scalefac_groups[id->g_side_info.mixed_block_flag[gr][ch] ? SCF_MIXED : SCF_SHORT];
+  else g = g_scalefac_groups[SCF_LONG]; /* block_type == 0 if winswitch == 0 */
+  w = Get_Main_Window(id);
+  avail = 57; /* At most 7 bits of the first byte are already used */
+  used = 0;
+  for(; g->count != 0; g++) {
+    if(g->win == 1) dst = &id->g_main_data.scalefac_l[gr][ch][g->sfb];
+    else dst = &id->g_main_data.scalefac_s[gr][ch][g->sfb][0];
+    n = g->count * g->win;
+    if((gr == 1) &&(g->scfsi < 4) &&(id->g_side_info.scfsi[ch][g->scfsi] == 1)) {
+      /* Copy scalefactors from granule 0 to granule 1 */
+      memcpy(dst,&id->g_main_data.scalefac_l[0][ch][g->sfb],n);
+      continue;
+    }
+    nbits = slen[g->slen];
+    if(nbits == 0) {
+      memset(dst,0,n);
+      continue;
+    }
+    for(i = 0; i < n; i++) {
+      if(avail < nbits) { /* Refill from the first unused bit */
+        Skip_Main_Bits(id,used);
+        w = Get_Main_Window(id);
+        avail = 57;
+        used = 0;
+      }
+      dst[i] = w >>(64 - nbits);
+      w <<= nbits;
+      avail -= nbits;
+      used += nbits;
+    }
+  }
+  Skip_Main_Bits(id,used);
+}
+
 /**Description: sets position of next bit to be read from main data bitstream.
 * Parameters: Stream handle,Bit position. 0 = start,8 = start of byte 1,etc.
 * Return value: PDMP3_OK or PDMP3_ERR if bit_pos is past end of main data for this frame.
@@ -1508,7 +1840,7 @@ static unsigned Get_Main_Bits(pdmp3_handle *id,unsigned number_of_bits){
   if(number_of_bits == 0) return(0);
 
   /* Form a word of the next four bytes */
-  tmp =(id->g_main_data_ptr[0] << 24) |(id->g_main_data_ptr[1] << 16) |
+  tmp =((unsigned) id->g_main_data_ptr[0] << 24) |(id->g_main_data_ptr[1] << 16) |
        (id->g_main_data_ptr[2] <<  8) |(id->g_main_data_ptr[3] <<  0);
 
   /* Remove bits already used */
@@ -1526,6 +1858,30 @@ static unsigned Get_Main_Bits(pdmp3_handle *id,unsigned number_of_bits){
 
 }
 
+/**Description: returns the next 64 bits of the main data bitstream without
+*  consuming them.
+* Parameters: Stream handle.
+* Return value: The bits,left aligned. Only the top 57 bits are valid.
+**/
+static uint64_t Get_Main_Window(pdmp3_handle *id){
+  const unsigned char *p = id->g_main_data_ptr;
+  uint64_t w;
+
+  w =((uint64_t) p[0] << 56) |((uint64_t) p[1] << 48) |((uint64_t) p[2] << 40) |
+     ((uint64_t) p[3] << 32) |((uint64_t) p[4] << 24) |((uint64_t) p[5] << 16) |
+     ((uint64_t) p[6] <<  8) |((uint64_t) p[7] <<  0);
+  return(w << id->g_main_data_idx);
+}
+
+/**Description: skips bits of the main data bitstream.
+* Parameters: Stream handle,number of bits.
+* Return value: None
+**/
+static void Skip_Main_Bits(pdmp3_handle *id,unsigned number_of_bits){
+  id->g_main_data_ptr +=(id->g_main_data_idx + number_of_bits) >> 3;
+  id->g_main_data_idx =(id->g_main_data_idx + number_of_bits) & 0x07;
+}
+
 /**Description: returns pos. of next bit to be read from main data bitstream.
 * Parameters: Stream handle.
 * Return value: Bit position.
@@ -1533,31 +1889,26 @@ static unsigned Get_Main_Bits(pdmp3_handle *id,unsigned number_of_bits){
 static unsigned Get_Main_Pos(pdmp3_handle *id){
   unsigned pos;
   
-  pos =((size_t) id->g_main_data_ptr) -((size_t) &(id->g_main_data_vec[0]));
-  pos /= 4; /* Divide by four to get number of bytes */
+  pos = id->g_main_data_ptr - id->g_main_data_vec; /* Number of bytes */
   pos *= 8;    /* Multiply by 8 to get number of bits */
   pos += id->g_main_data_idx;  /* Add current bit index */
   return(pos);
 }
 
-/**Description: reads 'number_of_bits' from buffer which contains side_info.
-* Parameters: Stream handle,number_of_bits to read(max 16)
-* Return value: The bits are returned in the LSB of the return value.
-* Author: Krister Lagerström(krister@kmlager.com) **/
-static unsigned Get_Side_Bits(pdmp3_handle *id,unsigned number_of_bits){
-  unsigned tmp;
-
-  /* Form a word of the next four bytes */                   //TODO endianness?
-  tmp =(id->side_info_ptr[0] << 24) |(id->side_info_ptr[1] << 16) |
-       (id->side_info_ptr[2] <<  8) |(id->side_info_ptr[3] <<  0);
-  /* Remove bits already used */
-  tmp = tmp << id->side_info_idx;
-  /* Remove bits after the desired bits */
-  tmp = tmp >>(32 - number_of_bits);
-  /* Update pointers */
-  id->side_info_ptr +=(id->side_info_idx + number_of_bits) >> 3;
-  id->side_info_idx =(id->side_info_idx + number_of_bits) & 0x07;
-  return(tmp);
+/**Description: returns 64 bits of side info starting at a bit offset.
+* Parameters: Stream handle,bit offset into the side info(max 197).
+* Return value: The bits,left aligned.
+**/
+static uint64_t Get_Side_Window(pdmp3_handle *id,unsigned bit_pos){
+  const unsigned char *p = &id->side_info_vec[bit_pos >> 3];
+  unsigned sh = bit_pos & 0x7;
+  uint64_t w;
+
+  w =((uint64_t) p[0] << 56) |((uint64_t) p[1] << 48) |((uint64_t) p[2] << 40) |
+     ((uint64_t) p[3] << 32) |((uint64_t) p[4] << 24) |((uint64_t) p[5] << 16) |
+     ((uint64_t) p[6] <<  8) |((uint64_t) p[7] <<  0);
+  if(sh != 0) w =(w << sh) |(p[8] >>(8 - sh));
+  return(w);
 }
 
 /**Description: TBD
@@ -1569,7 +1920,7 @@ static void Error(const char *s,int e){
   exit(e);
 }
 
-/**Description: Reads sideinfo from bitstream into buffer for Get_Side_Bits.
+/**Description: Reads sideinfo from bitstream into buffer for Get_Side_Window.
 * Parameters: Stream handle,TBD
 * Return value: TBD
 * Author: Krister Lagerström(krister@kmlager.com) **/
@@ -1579,10 +1930,6 @@ static void Get_Sideinfo(pdmp3_handle *id,unsigned sideinfo_size){
    sideinfo_size,Get_Filepos(id));
     return;
   }
-
-  id->side_info_ptr = &(id->side_info_vec[0]);
-  id->side_info_idx = 0;
-
 }
 
 /**Description: reads/decodes next Huffman code word from main_data reservoir.
@@ -1623,6 +1970,7 @@ static int Huffman_Decode(pdmp3_handle *id,unsigned table_num,int32_t *x,int32_t
     ERR("Illegal Huff code in data. bleft = %d,point = %d. tab = %d.",
       bitsleft,point,table_num);
     *x = *y = 0;
+    id->stats.huffman_errors++;
   }
   if(table_num > 31) {  /* Process sign encodings for quadruples tables. */
     *v =(*y >> 3) & 1;
@@ -1649,25 +1997,7 @@ static int Huffman_Decode(pdmp3_handle *id,unsigned table_num,int32_t *x,int32_t
 static void IMDCT_Win(float in[18],float out[36],unsigned block_type){
   unsigned i,m,N,p;
   float sum,tin[18];
-#ifndef IMDCT_TABLES
-  static float g_imdct_win[4][36];
-  static unsigned init = 1;
-//TODO : move to separate init function
-  if(init) { /* Setup the four(one for each block type) window vectors */
-    for(i = 0; i < 36; i++)  g_imdct_win[0][i] = sin(C_PI/36 *(i + 0.5)); //0
-    for(i = 0; i < 18; i++)  g_imdct_win[1][i] = sin(C_PI/36 *(i + 0.5)); //1
-    for(i = 18; i < 24; i++) g_imdct_win[1][i] = 1.0;
-    for(i = 24; i < 30; i++) g_imdct_win[1][i] = sin(C_PI/12 *(i + 0.5 - 18.0));
-    for(i = 30; i < 36; i++) g_imdct_win[1][i] = 0.0;
-    for(i = 0; i < 12; i++)  g_imdct_win[2][i] = sin(C_PI/12 *(i + 0.5)); //2
-    for(i = 12; i < 36; i++) g_imdct_win[2][i] = 0.0;
-    for(i = 0; i < 6; i++)   g_imdct_win[3][i] = 0.0; //3
-    for(i = 6; i < 12; i++)  g_imdct_win[3][i] = sin(C_PI/12 *(i + 0.5 - 6.0));
-    for(i = 12; i < 18; i++) g_imdct_win[3][i] = 1.0;
-    for(i = 18; i < 36; i++) g_imdct_win[3][i] = sin(C_PI/36 *(i + 0.5));
-    init = 0;
-  } /* end of init */
-#endif
+
   for(i = 0; i < 36; i++) out[i] = 0.0;
   for(i = 0; i < 18; i++) tin[i] = in[i];
   if(block_type == 2) { /* 3 short blocks */
@@ -1699,6 +2029,61 @@ static void IMDCT_Win(float in[18],float out[36],unsigned block_type){
   }
 }
 
+/**Description: IMDCT and windowing of one subband of both channels. The
+                windows and cosine tables are loaded once for both.
+* Parameters: Input vectors of the left and right channel,interleaved output
+              vector,block type.
+* Return value: None
+**/
+static void IMDCT_Win_Stereo(const float in0[18],const float in1[18],float out[36][2],unsigned block_type){
+  unsigned i,m,N,p;
+  float sum0,sum1,w;
+#ifdef IMDCT_NTABLES
+  float c;
+#else
+  double c; /* Same precision as the products in IMDCT_Win() */
+#endif
+
+  for(i = 0; i < 36; i++) out[i][0] = out[i][1] = 0.0;
+  if(block_type == 2) { /* 3 short blocks */
+    N = 12;
+    for(i = 0; i < 3; i++) {
+      for(p = 0; p < N; p++) {
+        sum0 = sum1 = 0.0;
+        for(m = 0;m < N/2; m++) {
+#ifdef IMDCT_NTABLES
+          c = cos_N12[m][p];
+#else
+          c = cos(C_PI/(2*N)*(2*p+1+N/2)*(2*m+1));
+#endif
+          sum0 += in0[i+3*m] * c;
+          sum1 += in1[i+3*m] * c;
+        }
+        w = g_imdct_win[block_type][p];
+        out[6*i+p+6][0] += sum0 * w;
+        out[6*i+p+6][1] += sum1 * w;
+      }
+    } /* end for(i... */
+  }else{ /* block_type != 2 */
+    N = 36;
+    for(p = 0; p < N; p++){
+      sum0 = sum1 = 0.0;
+      for(m = 0; m < N/2; m++) {
+#ifdef IMDCT_NTABLES
+        c = cos_N36[m][p];
+#else
+        c = cos(C_PI/(2*N)*(2*p+1+N/2)*(2*m+1));
+#endif
+        sum0 += in0[m] * c;
+        sum1 += in1[m] * c;
+      }
+      w = g_imdct_win[block_type][p];
+      out[p][0] = sum0 * w;
+      out[p][1] = sum1 * w;
+    }
+  }
+}
+
 /**Description: TBD
 * Parameters: Stream handle,TBD
 * Return value: TBD
@@ -1750,20 +2135,9 @@ static void L3_Frequency_Inversion(pdmp3_handle *id,unsigned gr,unsigned ch){
 * Return value: TBD
 * Author: Krister Lagerström(krister@kmlager.com) **/
 static void L3_Hybrid_Synthesis(pdmp3_handle *id,unsigned gr,unsigned ch){
-  unsigned sb,i,j,bt;
+  unsigned sb,i,bt;
   float rawout[36];
-  static float store[2][32][18];
 
-  if(id->hsynth_init) { /* Clear stored samples vector. OPT? use memset */
-    for(j = 0; j < 2; j++) {
-      for(sb = 0; sb < 32; sb++) {
-        for(i = 0; i < 18; i++) {
-          store[j][sb][i] = 0.0;
-        }
-      }
-    }
-    id->hsynth_init = 0;
-  } /* end if(hsynth_init) */
   for(sb = 0; sb < 32; sb++) { /* Loop through all 32 subbands */
     /* Determine blocktype for this subband */
     bt =((id->g_side_info.win_switch_flag[gr][ch] == 1) &&
@@ -1772,13 +2146,46 @@ static void L3_Hybrid_Synthesis(pdmp3_handle *id,unsigned gr,unsigned ch){
     /* Do the inverse modified DCT and windowing */
     IMDCT_Win(&(id->g_main_data.is[gr][ch][sb*18]),rawout,bt);
     for(i = 0; i < 18; i++) { /* Overlapp add with stored vector into main_data vector */
-      id->g_main_data.is[gr][ch][sb*18 + i] = rawout[i] + store[ch][sb][i];
-      store[ch][sb][i] = rawout[i + 18];
+      id->g_main_data.is[gr][ch][sb*18 + i] = rawout[i] + id->store[sb][i][ch];
+      id->store[sb][i][ch] = rawout[i + 18];
     } /* end for(i... */
   } /* end for(sb... */
   return; /* Done */
 }
 
+/**Description: hybrid synthesis of both channels of a stereo granule.
+                Subbands with the same block type in both channels share
+                one IMDCT_Win_Stereo() pass.
+* Parameters: Stream handle,granule.
+* Return value: None
+**/
+static void L3_Hybrid_Synthesis_Stereo(pdmp3_handle *id,unsigned gr){
+  unsigned sb,i,ch,bt[2];
+  float rawout[36][2],mono[36];
+
+  for(sb = 0; sb < 32; sb++) { /* Loop through all 32 subbands */
+    for(ch = 0; ch < 2; ch++) /* Determine blocktype for this subband */
+      bt[ch] =((id->g_side_info.win_switch_flag[gr][ch] == 1) &&
+       (id->g_side_info.mixed_block_flag[gr][ch] == 1) &&(sb < 2))
+        ? 0 : id->g_side_info.block_type[gr][ch];
+    if(bt[0] == bt[1]) {
+      IMDCT_Win_Stereo(&(id->g_main_data.is[gr][0][sb*18]),
+                       &(id->g_main_data.is[gr][1][sb*18]),rawout,bt[0]);
+    }else{
+      for(ch = 0; ch < 2; ch++) {
+        IMDCT_Win(&(id->g_main_data.is[gr][ch][sb*18]),mono,bt[ch]);
+        for(i = 0; i < 36; i++) rawout[i][ch] = mono[i];
+      }
+    }
+    for(i = 0; i < 18; i++) { /* Overlapp add with stored vector into main_data vector */
+      id->g_main_data.is[gr][0][sb*18 + i] = rawout[i][0] + id->store[sb][i][0];
+      id->g_main_data.is[gr][1][sb*18 + i] = rawout[i][1] + id->store[sb][i][1];
+      id->store[sb][i][0] = rawout[i + 18][0];
+      id->store[sb][i][1] = rawout[i + 18][1];
+    } /* end for(i... */
+  } /* end for(sb... */
+}
+
 /**Description: TBD
 * Parameters: Stream handle,TBD
 * Return value: TBD
@@ -1971,51 +2378,151 @@ static void L3_Stereo(pdmp3_handle *id,unsigned gr){
   } /* end if(intensity_stereo processing) */
 }
 
+/**Description: the antialias butterflies at one subband boundary.
+* Parameters: Frequency lines of a channel,subband above the boundary.
+* Return value: None
+**/
+static inline void Antialias_Boundary(float *xr,unsigned sb){
+  unsigned i;
+  float lb,ub;
+
+  for(i = 0; i < 8; i++) {
+    lb = xr[18*sb-1-i]*cs[i] - xr[18*sb+i]*ca[i];
+    ub = xr[18*sb+i]*cs[i] + xr[18*sb-1-i]*ca[i];
+    xr[18*sb-1-i] = lb;
+    xr[18*sb+i] = ub;
+  }
+}
+
+/**Description: the spectral stage of a granule in one sweep over the
+                scalefactor bands. Each band is requantized in both channels,
+                short block bands straight into their reordered positions,
+                then gets its stereo processing,and the antialias butterflies
+                run as soon as the lines around a subband boundary are final.
+                Gains are computed per band instead of per line. The result
+                is the same as that of L3_Requantize(),L3_Reorder(),
+                L3_Stereo() and L3_Antialias(),which granules whose channels
+                use different block layouts still go through.
+* Parameters: Stream handle,granule.
+* Return value: None
+**/
+static void L3_Spectrum(pdmp3_handle *id,unsigned gr){
+  const t_sf_band_indices *bands = &g_sf_band_indices[id->g_frame_header.sampling_frequency];
+  t_mpeg1_side_info *si = &id->g_side_info;
+  unsigned nch,ch,shrt,mixed,long_band,sfb,start,stop,end,win,win_len,i,j,sb,sblim;
+  unsigned ms_pos = 0,is_on = 0;
+  float tmp1,tmp2,gain,sf_mult,x,left,right,re[3*66],*xr; /* Widest short band,48 kHz */
+
+  nch =(id->g_frame_header.mode == mpeg1_mode_single_channel ? 1 : 2);
+  shrt =(si->win_switch_flag[gr][0] == 1) &&(si->block_type[gr][0] == 2);
+  mixed = shrt &&(si->mixed_block_flag[gr][0] != 0);
+  if((nch == 2) &&
+     ((shrt != ((si->win_switch_flag[gr][1] == 1) &&(si->block_type[gr][1] == 2))) ||
+      (shrt &&(mixed !=(si->mixed_block_flag[gr][1] != 0))))) {
+    for(ch = 0; ch < 2; ch++) {
+      L3_Requantize(id,gr,ch);
+      L3_Reorder(id,gr,ch);
+    }
+    L3_Stereo(id,gr);
+    L3_Antialias(id,gr,0);
+    L3_Antialias(id,gr,1);
+    return; /* Done */
+  }
+  if((id->g_frame_header.mode == 1) &&(id->g_frame_header.mode_extension & 0x2))
+    ms_pos = si->count1[gr][!!(si->count1[gr][0] > si->count1[gr][1])]; /* As L3_Stereo() */
+  is_on =(id->g_frame_header.mode == 1) &&(id->g_frame_header.mode_extension & 0x1);
+  /* Lines from the larger count1 on are zero,and stay zero */
+  end = si->count1[gr][0];
+  if((nch == 2) &&(si->count1[gr][1] > end)) end = si->count1[gr][1];
+  sblim = mixed ? 2 :(shrt ? 1 : 32); /* Subband boundaries to antialias */
+  sb = 1;
+  long_band = !shrt || mixed;
+  sfb = 0;
+  for(start = 0; start < end; start = stop) {
+    win_len = 0;
+    if(long_band) stop = bands->l[sfb+1];
+    else{
+      win_len = bands->s[sfb+1] - bands->s[sfb];
+      stop = 3*bands->s[sfb+1];
+    }
+    for(ch = 0; ch < nch; ch++) { /* Requantize(and reorder)the band */
+      if(start >= si->count1[gr][ch]) continue; /* Zero band */
+      xr = id->g_main_data.is[gr][ch];
+      if(long_band) {
+        sf_mult = si->scalefac_scale[gr][ch] ? 1.0 : 0.5;
+        tmp1 = pow(2.0,-(sf_mult *(id->g_main_data.scalefac_l[gr][ch][sfb] +
+                                    si->preflag[gr][ch] * pretab[sfb])));
+        tmp2 = pow(2.0,0.25 *((int32_t) si->global_gain[gr][ch] - 210));
+        gain = tmp1 * tmp2;
+        for(i = start; i < stop; i++)
+          xr[i] = gain *((xr[i] < 0.0) ? -Requantize_Pow_43(-xr[i]) : Requantize_Pow_43(xr[i]));
+      }else{
+        sf_mult = si->scalefac_scale[gr][ch] ? 1.0f : 0.5f;
+        for(win = 0; win < 3; win++) {
+          tmp1 = pow(2.0f,-(sf_mult * id->g_main_data.scalefac_s[gr][ch][sfb][win]));
+          tmp2 = pow(2.0f,0.25f *((float) si->global_gain[gr][ch] - 210.0f -
+                      8.0f *(float) si->subblock_gain[gr][ch][win]));
+          gain = tmp1 * tmp2;
+          for(j = 0; j < win_len; j++) {
+            x = xr[start + win*win_len + j];
+            re[j*3 + win] = gain *((x < 0.0) ? -Requantize_Pow_43(-x) : Requantize_Pow_43(x));
+          }
+        }
+        memcpy(&xr[start],re,3*win_len*sizeof(float));
+      }
+    } /* end for(ch... */
+    for(i = start; (i < stop) &&(i < ms_pos); i++) { /* Middle/side stereo */
+      left =(id->g_main_data.is[gr][0][i] + id->g_main_data.is[gr][1][i])
+        *(C_INV_SQRT_2);
+      right =(id->g_main_data.is[gr][0][i] - id->g_main_data.is[gr][1][i])
+        *(C_INV_SQRT_2);
+      id->g_main_data.is[gr][0][i] = left;
+      id->g_main_data.is[gr][1][i] = right;
+    }
+    if(is_on &&(start >= si->count1[gr][1])) { /* Intensity stereo */
+      if(long_band) {
+        if(sfb < 21) Stereo_Process_Intensity_Long(id,gr,sfb);
+      }else if(sfb < 12) Stereo_Process_Intensity_Short(id,gr,sfb);
+    }
+    for(; (sb < sblim) &&(18*sb + 8 <= stop); sb++) /* Antialias */
+      for(ch = 0; ch < nch; ch++) Antialias_Boundary(id->g_main_data.is[gr][ch],sb);
+    if(long_band && mixed &&(stop == 36)) { /* On to the short blocks */
+      long_band = 0;
+      sfb = 3;
+    }else sfb++;
+  } /* end for(start... */
+  /* Boundaries with nonzero lines below them that the sweep didn't reach */
+  for(; (sb < sblim) &&(18*sb < start + 8); sb++)
+    for(ch = 0; ch < nch; ch++) Antialias_Boundary(id->g_main_data.is[gr][ch],sb);
+}
+
 /**Description: TBD
 * Parameters: Stream handle,TBD
 * Return value: TBD
 * Author: Krister Lagerström(krister@kmlager.com) **/
-static void L3_Subband_Synthesis(pdmp3_handle *id,unsigned gr,unsigned ch,unsigned outdata[576]){
+static void L3_Subband_Synthesis(pdmp3_handle *id,unsigned gr,unsigned ch,int16_t *outdata){
   float u_vec[512],s_vec[32],sum; /* u_vec can be used insted of s_vec */
   int32_t samp;
-  static unsigned init = 1;
-  unsigned i,j,ss,nch;
-  static float g_synth_n_win[64][32],v_vec[2 /* ch */][1024];
+  unsigned i,j,ss,nch,clipped = 0;
+  float (*v_vec)[2] = id->v_vec;
 
   /* Number of channels(1 for mono and 2 for stereo) */
   nch =(id->g_frame_header.mode == mpeg1_mode_single_channel) ? 1 : 2 ;
-  /* Setup the n_win windowing vector and the v_vec intermediate vector */
-
-  if(init) {
-    for(i = 0; i < 64; i++) {
-      for(j = 0; j < 32; j++) /*TODO: put in lookup table*/
-        g_synth_n_win[i][j] = cos(((float)(16+i)*(2*j+1)) *(C_PI/64.0));
-    }
-    for(i = 0; i < 2; i++) /* Setup the v_vec intermediate vector */
-      for(j = 0; j < 1024; j++) v_vec[i][j] = 0.0; /*TODO: memset */
-    init = 0;
-  } /* end if(init) */
-
-  if(id->synth_init) {
-    for(i = 0; i < 2; i++) /* Setup the v_vec intermediate vector */
-      for(j = 0; j < 1024; j++) v_vec[i][j] = 0.0; /*TODO: memset*/
-    id->synth_init = 0;
-  } /* end if(synth_init) */
 
   for(ss = 0; ss < 18; ss++){ /* Loop through 18 samples in 32 subbands */
     for(i = 1023; i > 63; i--)  /* Shift up the V vector */
-      v_vec[ch][i] = v_vec[ch][i-64];
+      v_vec[i][ch] = v_vec[i-64][ch];
     for(i = 0; i < 32; i++) /* Copy next 32 time samples to a temp vector */
       s_vec[i] =((float) id->g_main_data.is[gr][ch][i*18 + ss]);
     for(i = 0; i < 64; i++){ /* Matrix multiply input with n_win[][] matrix */
       sum = 0.0;
       for(j = 0; j < 32; j++) sum += g_synth_n_win[i][j] * s_vec[j];
-      v_vec[ch][i] = sum;
+      v_vec[i][ch] = sum;
     } /* end for(i... */
     for(i = 0; i < 8; i++) { /* Build the U vector */
       for(j = 0; j < 32; j++) { /* <<7 == *128 */
-        u_vec[(i << 6) + j]      = v_vec[ch][(i << 7) + j];
-        u_vec[(i << 6) + j + 32] = v_vec[ch][(i << 7) + j + 96];
+        u_vec[(i << 6) + j]      = v_vec[(i << 7) + j][ch];
+        u_vec[(i << 6) + j + 32] = v_vec[(i << 7) + j + 96][ch];
       }
     } /* end for(i... */
     for(i = 0; i < 512; i++) /* Window by u_vec[i] with g_synth_dtbl[i] */
@@ -2026,24 +2533,76 @@ static void L3_Subband_Synthesis(pdmp3_handle *id,unsigned gr,unsigned ch,unsign
         sum += u_vec[(j << 5) + i];
       /* sum now contains time sample 32*ss+i. Convert to 16-bit signed int */
       samp =(int32_t)(sum * 32767.0);
+      clipped +=(samp > 32767) |(samp < -32767);
       if(samp > 32767) samp = 32767;
       else if(samp < -32767) samp = -32767;
-      samp &= 0xffff;
-      if(ch == 0) {  /* This function must be called for channel 0 first */
-        /* We always run in stereo mode,& duplicate channels here for mono */
-        if(nch == 1) {
-          outdata[32*ss + i] =(samp << 16) |(samp);
-        }else{
-          outdata[32*ss + i] = samp << 16;
-        }
-      }else{
-        outdata[32*ss + i] |= samp;
-      }
+      outdata[(32*ss + i)*nch + ch] = samp; /* Interleaved with the other channel */
     } /* end for(i... */
   } /* end for(ss... */
+  id->stats.clipped += clipped;
   return; /* Done */
 }
 
+/**Description: polyphase subband synthesis of both channels of a stereo
+                granule. Every table load serves both channels,and the
+                samples are interleaved into outdata as they are produced.
+* Parameters: Stream handle,granule,outdata vector.
+* Return value: None
+**/
+static void L3_Subband_Synthesis_Stereo(pdmp3_handle *id,unsigned gr,int16_t *outdata){
+  float u_vec[512][2],s_vec[32][2],sum0,sum1,w;
+  int32_t samp0,samp1;
+  unsigned i,j,ss,clipped = 0;
+  float (*v_vec)[2] = id->v_vec;
+
+  for(ss = 0; ss < 18; ss++){ /* Loop through 18 samples in 32 subbands */
+    memmove(v_vec[64],v_vec[0],960*sizeof(v_vec[0])); /* Shift up the V vector */
+    for(i = 0; i < 32; i++) { /* Copy next 32 time samples to a temp vector */
+      s_vec[i][0] = id->g_main_data.is[gr][0][i*18 + ss];
+      s_vec[i][1] = id->g_main_data.is[gr][1][i*18 + ss];
+    }
+    for(i = 0; i < 64; i++){ /* Matrix multiply input with n_win[][] matrix */
+      sum0 = sum1 = 0.0;
+      for(j = 0; j < 32; j++) {
+        w = g_synth_n_win[i][j];
+        sum0 += w * s_vec[j][0];
+        sum1 += w * s_vec[j][1];
+      }
+      v_vec[i][0] = sum0;
+      v_vec[i][1] = sum1;
+    } /* end for(i... */
+    for(i = 0; i < 8; i++) { /* Build the U vector,windowed by g_synth_dtbl */
+      for(j = 0; j < 32; j++) { /* <<7 == *128 */
+        w = g_synth_dtbl[(i << 6) + j];
+        u_vec[(i << 6) + j][0] = v_vec[(i << 7) + j][0] * w;
+        u_vec[(i << 6) + j][1] = v_vec[(i << 7) + j][1] * w;
+        w = g_synth_dtbl[(i << 6) + j + 32];
+        u_vec[(i << 6) + j + 32][0] = v_vec[(i << 7) + j + 96][0] * w;
+        u_vec[(i << 6) + j + 32][1] = v_vec[(i << 7) + j + 96][1] * w;
+      }
+    } /* end for(i... */
+    for(i = 0; i < 32; i++) { /* Calc 32 samples,store in outdata vector */
+      sum0 = sum1 = 0.0;
+      for(j = 0; j < 16; j++) {
+        sum0 += u_vec[(j << 5) + i][0];
+        sum1 += u_vec[(j << 5) + i][1];
+      }
+      /* Convert to 16-bit signed int */
+      samp0 =(int32_t)(sum0 * 32767.0);
+      samp1 =(int32_t)(sum1 * 32767.0);
+      clipped +=(samp0 > 32767) |(samp0 < -32767);
+      clipped +=(samp1 > 32767) |(samp1 < -32767);
+      if(samp0 > 32767) samp0 = 32767;
+      else if(samp0 < -32767) samp0 = -32767;
+      if(samp1 > 32767) samp1 = 32767;
+      else if(samp1 < -32767) samp1 = -32767;
+      outdata[2*(32*ss + i)] = samp0;
+      outdata[2*(32*ss + i) + 1] = samp1;
+    } /* end for(i... */
+  } /* end for(ss... */
+  id->stats.clipped += clipped;
+}
+
 /**Description: called by Read_Main_L3 to read Huffman coded data from bitstream.
 * Parameters: Stream handle,TBD
 * Return value: None. The data is stored in id->g_main_data.is[ch][gr][freqline].
@@ -2075,7 +2634,8 @@ static void Read_Huffman(pdmp3_handle *id,unsigned part_2_start,unsigned gr,unsi
         id->g_side_info.region1_count[gr][ch] + 2];
   }
   /* Read big_values using tables according to region_x_start */
-  for(is_pos = 0; is_pos < id->g_side_info.big_values[gr][ch] * 2; is_pos++) {
+  for(is_pos = 0;(is_pos < id->g_side_info.big_values[gr][ch] * 2) &&
+      (Get_Main_Pos(id) <= bit_pos_end); is_pos++) {
     if(is_pos < region_1_start) {
       table_num = id->g_side_info.table_select[gr][ch][0];
     } else if(is_pos < region_2_start) {
@@ -2087,6 +2647,9 @@ static void Read_Huffman(pdmp3_handle *id,unsigned part_2_start,unsigned gr,unsi
     id->g_main_data.is[gr][ch][is_pos++] = x;
     id->g_main_data.is[gr][ch][is_pos] = y;
   }
+  /* Corrupt big_values ran past the end of this section */
+  for(/* is_pos comes from last for-loop */; is_pos < id->g_side_info.big_values[gr][ch] * 2; is_pos++)
+    id->g_main_data.is[gr][ch][is_pos] = 0.0;
   /* Read small values until is_pos = 576 or we run out of huffman data */
   table_num = id->g_side_info.count1table_select[gr][ch] + 32;
   for(is_pos = id->g_side_info.big_values[gr][ch] * 2;
@@ -2102,7 +2665,8 @@ static void Read_Huffman(pdmp3_handle *id,unsigned part_2_start,unsigned gr,unsi
     id->g_main_data.is[gr][ch][is_pos] = y;
   }
   /* Check that we didn't read past the end of this section */
-  if(Get_Main_Pos(id) >(bit_pos_end+1)) /* Remove last words read */
+  if((Get_Main_Pos(id) >(bit_pos_end+1)) && /* Remove last words read */
+     (is_pos >= id->g_side_info.big_values[gr][ch] * 2 + 4))
     is_pos -= 4;
   /* Setup count1 which is the index of the first sample in the rzero reg. */
   id->g_side_info.count1[gr][ch] = is_pos;
@@ -2120,7 +2684,6 @@ static void Read_Huffman(pdmp3_handle *id,unsigned part_2_start,unsigned gr,unsi
 * Author: Krister Lagerström(krister@kmlager.com) **/
 static void Requantize_Process_Long(pdmp3_handle *id,unsigned gr,unsigned ch,unsigned is_pos,unsigned sfb){
   float tmp1,tmp2,tmp3,sf_mult,pf_x_pt;
-  static float pretab[21] = { 0,0,0,0,0,0,0,0,0,0,0,1,1,1,1,2,2,3,3,3,2 };
 
   sf_mult = id->g_side_info.scalefac_scale[gr][ch] ? 1.0 : 0.5;
   pf_x_pt = id->g_side_info.preflag[gr][ch] * pretab[sfb];
@@ -2219,53 +2782,168 @@ static void Stereo_Process_Intensity_Short(pdmp3_handle *id,unsigned gr,unsigned
   return; /* Done */
 } /* end Stereo_Process_Intensity_Short() */
 
-#ifdef OUTPUT_RAW
-/******************************************************************************
-*
-* Name: audio_write_raw
-* Author: Krister Lagerström(krister@unidata.se)
-* Description: This function is used to output raw data
-* Parameters: Stream handle,file name,pointers to the samples,the number of
-              samples
+#if defined(OUTPUT_RAW) || defined(OUTPUT_WAV)
+#define OUTFILE_BUF_SIZE (1 << 20) /* Write through 1 MB blocks */
+#define WAV_HEADER_SIZE  44
+
+typedef struct {
+  int fd;
+  unsigned char *buf;  /* OUTFILE_BUF_SIZE bytes,page aligned */
+  size_t fill;         /* Bytes pending in buf */
+  uint64_t size;       /* PCM bytes written so far */
+  unsigned rate,nch;   /* Format of the first frame */
+  char header;         /* WAV header written */
+}
+t_outfile;
+
+static t_outfile g_outfile = { -1 };
+
+/**Description: writes all of 'nbytes' to a file descriptor.
+* Parameters: File descriptor,data,number of bytes.
+* Return value: None,exits on error.
+**/
+static void Write_All(int fd,const unsigned char *data,size_t nbytes){
+  ssize_t res;
+
+  while(nbytes) {
+    res = write(fd,data,nbytes);
+    if(res < 0) Error("Unable to write audio data\n",-1);
+    data += res;
+    nbytes -= res;
+  }
+}
+
+#ifdef OUTPUT_WAV
+static void Put_Le(unsigned char *p,uint32_t v,unsigned nbytes){
+  while(nbytes--) {
+    *p++ = v & 0xff;
+    v >>= 8;
+  }
+}
+
+/**Description: fills in a 44 byte canonical WAV header for S16 PCM.
+* Parameters: Header buffer,sample rate,number of channels,PCM data size.
 * Return value: None
-* Revision History:
-* Author   Date    Change
-* krister  010101  Initial revision
-*
-******************************************************************************/
-static void audio_write_raw(const char *filename,unsigned *samples,unsigned nbytes){
-  static int init = 0,fd;
+**/
+static void Wav_Header(unsigned char h[WAV_HEADER_SIZE],unsigned rate,unsigned nch,uint64_t size){
+  uint32_t data = (size > 0xffffffff - 36) ? 0xffffffff - 36 : size;
+
+  memcpy(h,"RIFF",4);
+  Put_Le(h+4,data + 36,4);
+  memcpy(h+8,"WAVEfmt ",8);
+  Put_Le(h+16,16,4);              /* fmt chunk size */
+  Put_Le(h+20,1,2);               /* PCM */
+  Put_Le(h+22,nch,2);
+  Put_Le(h+24,rate,4);
+  Put_Le(h+28,rate*nch*2,4);      /* Byte rate */
+  Put_Le(h+32,nch*2,2);           /* Block align */
+  Put_Le(h+34,16,2);              /* Bits per sample */
+  memcpy(h+36,"data",4);
+  Put_Le(h+40,data,4);
+}
+#endif
+
+/**Description: opens <filename>.raw or <filename>.wav for writing,or
+                standard output if the input is read from standard input.
+* Parameters: Input file name.
+* Return value: None
+**/
+static void audio_open_file(const char *filename){
   char fname[1024];
 
-  if(init == 0) {
-    init = 1;
-    if(strcmp(filename,"-")) {
-      snprintf(fname,1023,"%s.raw",filename);
-      fd = open(fname,O_WRONLY | O_CREAT,0666);
-      if(fd == -1) {
-        perror(fname);
-        exit(-1);
-      }
-    } else {
-      fd = 1;
+  if(g_outfile.buf == NULL &&
+     posix_memalign((void **)&g_outfile.buf,4096,OUTFILE_BUF_SIZE) != 0)
+    Error("Unable to allocate the output buffer\n",-1);
+  if(strcmp(filename,"-")) {
+#ifdef OUTPUT_WAV
+    snprintf(fname,sizeof(fname),"%s.wav",filename);
+#else
+    snprintf(fname,sizeof(fname),"%s.raw",filename);
+#endif
+    g_outfile.fd = open(fname,O_WRONLY | O_CREAT | O_TRUNC,0666);
+    if(g_outfile.fd == -1) {
+      perror(fname);
+      exit(-1);
     }
+  } else {
+    g_outfile.fd = 1;
   }
+  g_outfile.fill = 0;
+  g_outfile.size = 0;
+  g_outfile.header = 0;
+}
 
-  if(write(fd,samples,nbytes) != nbytes)
-    Error("Unable to write raw data\n",-1);
-  return;
-} /* audio_write_raw() */
+static void audio_flush_file(void){
+  Write_All(g_outfile.fd,g_outfile.buf,g_outfile.fill);
+  g_outfile.fill = 0;
+}
+
+/**Description: appends PCM data to the output file through the block buffer.
+* Parameters: Sample rate,number of channels,pointer to the samples,number
+              of bytes.
+* Return value: None
+**/
+static void audio_write_file(unsigned rate,unsigned nch,const unsigned char *samples,size_t nbytes){
+  size_t n;
+
+#ifdef OUTPUT_WAV
+  if(!g_outfile.header && nbytes) { /* Sizes are patched when the file is closed */
+    g_outfile.rate = rate;
+    g_outfile.nch = nch;
+    Wav_Header(g_outfile.buf,g_outfile.rate,g_outfile.nch,0xffffffff);
+    g_outfile.fill = WAV_HEADER_SIZE;
+    g_outfile.header = 1;
+  }
+#endif
+  g_outfile.size += nbytes;
+  while(nbytes) {
+    if(g_outfile.fill == 0 && nbytes >= OUTFILE_BUF_SIZE) {
+      n = nbytes - nbytes % OUTFILE_BUF_SIZE; /* Large writes bypass the buffer */
+      Write_All(g_outfile.fd,samples,n);
+    }else{
+      n = OUTFILE_BUF_SIZE - g_outfile.fill;
+      if(n > nbytes) n = nbytes;
+      memcpy(g_outfile.buf + g_outfile.fill,samples,n);
+      g_outfile.fill += n;
+      if(g_outfile.fill == OUTFILE_BUF_SIZE) audio_flush_file();
+    }
+    samples += n;
+    nbytes -= n;
+  }
+}
+
+/**Description: flushes and closes the output file,patching the WAV sizes
+                if the file is seekable.
+* Parameters: None
+* Return value: None
+**/
+static void audio_close_file(void){
+#ifdef OUTPUT_WAV
+  unsigned char h[WAV_HEADER_SIZE];
 #endif
 
+  if(g_outfile.fd == -1) return;
+  audio_flush_file();
+#ifdef OUTPUT_WAV
+  if(g_outfile.header) {
+    Wav_Header(h,g_outfile.rate,g_outfile.nch,g_outfile.size);
+    (void) pwrite(g_outfile.fd,h,WAV_HEADER_SIZE,0); /* Fails for pipes */
+  }
+#endif
+  if(g_outfile.fd != 1) close(g_outfile.fd);
+  g_outfile.fd = -1;
+}
+#endif /* OUTPUT_RAW || OUTPUT_WAV */
+
 /**Description: output audio data
-* Parameters: Stream handle,audio device name,file name.
+* Parameters: Sample rate,number of channels,audio device name,file name.
 * Return value: None
 * Author: Krister Lagerström(krister@kmlager.com) **/
-static void audio_write(pdmp3_handle *id,const char *audio_name,const char *filename,unsigned char *samples,size_t nbytes){
+static void audio_write_pcm(unsigned rate,unsigned nch,const char *audio_name,const char *filename,unsigned char *samples,size_t nbytes){
 #ifdef OUTPUT_SOUND
   static int init = 0,audio,curr_sample_rate = 0;
   int format = AFMT_S16_LE,tmp,dsp_speed = 44100,dsp_stereo = 2;
-  int sample_rate = g_sampling_frequency[id->g_frame_header.sampling_frequency];
+  int sample_rate = rate;
 
   if(init == 0) {
     init = 1;
@@ -2291,92 +2969,967 @@ static void audio_write(pdmp3_handle *id,const char *audio_name,const char *file
   if(write(audio,samples,nbytes) != nbytes)
     Error("Unable to write audio data\n",-1);
 #endif /* OUTPUT_SOUND */
-#ifdef OUTPUT_RAW
-  audio_write_raw(filename,samples,nbytes);
-#endif /* OUTPUT_RAW */
+#if defined(OUTPUT_RAW) || defined(OUTPUT_WAV)
+  audio_write_file(rate,nch,samples,nbytes);
+#endif /* OUTPUT_RAW || OUTPUT_WAV */
   return;
+} /* audio_write_pcm() */
+
+#ifndef OUTPUT_ASYNC
+static void audio_write(pdmp3_handle *id,const char *audio_name,const char *filename,unsigned char *samples,size_t nbytes){
+  audio_write_pcm(g_sampling_frequency[id->g_frame_header.sampling_frequency],
+                  id->g_frame_header.mode == mpeg1_mode_single_channel ? 1 : 2,
+                  audio_name,filename,samples,nbytes);
 } /* audio_write() */
+#endif
 
+#ifdef OUTPUT_ASYNC
+/* Asynchronous output: the decoder fills slots of a ring which a writer
+ * thread drains into the sink,so neither side stalls the other. When the
+ * output is a pipe the slots are vmsplice()d: the pipe then references the
+ * slot pages instead of a copy,so a slot is only refilled once the reader
+ * has consumed it,which is tracked through FIONREAD. A reader that splices
+ * the data onward instead of reading it keeps referencing the pages and
+ * must not be used with this mode. */
+#define ASYNC_SLOTS      8
+#define ASYNC_SLOT_SIZE  (64*1024) /* Multiple of the page size */
+
+typedef struct {
+  unsigned char *data;  /* ASYNC_SLOT_SIZE bytes,page aligned */
+  size_t len;
+  unsigned rate,nch;
+  uint64_t end;         /* Bytes pushed to the sink including this slot */
+}
+t_async_slot;
+
+static struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  t_async_slot slot[ASYNC_SLOTS];
+  unsigned filled;      /* Slots handed over by the decoder */
+  unsigned written;     /* Slots passed on to the sink */
+  unsigned released;    /* Slots that may be filled again */
+  uint64_t pushed;      /* Bytes pushed to the sink */
+  int splice;           /* Sink is a pipe,use vmsplice() */
+  int running,stop;
+  const char *audio_name,*filename;
+}
+g_async = { .lock = PTHREAD_MUTEX_INITIALIZER,.cond = PTHREAD_COND_INITIALIZER };
 
-/*#############################################################################
- * Stream API - Added for AeonWave Audio (http://www.adalin.com)
+/**Description: releases slots the sink no longer references. Called with
+                the lock held.
+* Parameters: None
+* Return value: None
+**/
+static void Async_Reclaim(void){
+#if defined(OUTPUT_RAW) || defined(OUTPUT_WAV)
+  struct pollfd pfd;
+  int unread = 0;
+  uint64_t consumed;
+#endif
+
+  if(!g_async.splice) {
+    g_async.released = g_async.written;
+    return;
+  }
+#if defined(OUTPUT_RAW) || defined(OUTPUT_WAV)
+  if(ioctl(g_outfile.fd,FIONREAD,&unread) == -1) unread = 0;
+  pfd.fd = g_outfile.fd;
+  pfd.events = 0;
+  if((poll(&pfd,1,0) == 1) &&(pfd.revents & POLLERR))
+    unread = 0; /* The reader is gone,nothing will read what is left */
+  consumed = g_async.pushed - unread;
+  while((g_async.released != g_async.written) &&
+        (g_async.slot[g_async.released % ASYNC_SLOTS].end <= consumed))
+    g_async.released++;
+#endif
+}
+
+#if defined(OUTPUT_RAW) || defined(OUTPUT_WAV)
+static void Async_Push(const unsigned char *data,size_t nbytes){
+  struct iovec iov;
+  ssize_t res;
+
+  iov.iov_base = (void *) data;
+  iov.iov_len = nbytes;
+  while(iov.iov_len) {
+    res = vmsplice(g_outfile.fd,&iov,1,0);
+    if(res < 0) {
+      if(errno == EINTR) continue;
+      Error("Unable to write audio data\n",-1);
+    }
+    iov.iov_base = (char *) iov.iov_base + res;
+    iov.iov_len -= res;
+  }
+}
+#endif /* OUTPUT_RAW || OUTPUT_WAV */
+
+static void Async_Write_Slot(t_async_slot *s){
+#ifdef OUTPUT_WAV
+  unsigned char h[WAV_HEADER_SIZE];
+#endif
+
+  if(!g_async.splice) {
+    audio_write_pcm(s->rate,s->nch,g_async.audio_name,g_async.filename,s->data,s->len);
+    return;
+  }
+#if defined(OUTPUT_RAW) || defined(OUTPUT_WAV)
+#ifdef OUTPUT_WAV
+  if(!g_outfile.header && s->len) {
+    Wav_Header(h,s->rate,s->nch,0xffffffff);
+    Write_All(g_outfile.fd,h,WAV_HEADER_SIZE);
+    g_async.pushed += WAV_HEADER_SIZE;
+    g_outfile.header = 1;
+  }
+#endif
+  Async_Push(s->data,s->len);
+  g_async.pushed += s->len;
+  s->end = g_async.pushed;
+#endif
+}
+
+static void *Async_Writer(void *arg){
+  t_async_slot *s;
+
+  pthread_mutex_lock(&g_async.lock);
+  for(;;) {
+    while((g_async.written == g_async.filled) && !g_async.stop)
+      pthread_cond_wait(&g_async.cond,&g_async.lock);
+    if(g_async.written == g_async.filled) break;
+    s = &g_async.slot[g_async.written % ASYNC_SLOTS];
+    pthread_mutex_unlock(&g_async.lock);
+    Async_Write_Slot(s);
+    pthread_mutex_lock(&g_async.lock);
+    g_async.written++;
+    Async_Reclaim();
+    pthread_cond_broadcast(&g_async.cond);
+  }
+  pthread_mutex_unlock(&g_async.lock);
+  return(NULL);
+}
+
+/**Description: waits until the ring has room,called with the lock held.
+                A full ring of spliced slots is polled since only the pipe
+                reader can free it.
+* Parameters: Number of slots that may stay in use.
+* Return value: None
+**/
+static void Async_Wait(unsigned in_use){
+  struct timespec ts;
+
+  for(;;) {
+    Async_Reclaim();
+    if(g_async.filled - g_async.released <= in_use) break;
+    if(g_async.splice && g_async.written == g_async.filled) {
+      clock_gettime(CLOCK_REALTIME,&ts);
+      ts.tv_nsec += 1000000;
+      if(ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&g_async.cond,&g_async.lock,&ts);
+    }else pthread_cond_wait(&g_async.cond,&g_async.lock);
+  }
+}
+
+/**Description: prepares the asynchronous output for a new file.
+* Parameters: Audio device name,file name,pointer to return the size of
+              the returned buffer.
+* Return value: Buffer to decode into.
+**/
+static unsigned char *Async_Open(const char *audio_name,const char *filename,size_t *size){
+  unsigned i;
+#if defined(OUTPUT_RAW) || defined(OUTPUT_WAV)
+  struct stat st;
+  int unread;
+#endif
+
+  if(!g_async.running) {
+    for(i = 0; i < ASYNC_SLOTS; i++)
+      if(posix_memalign((void **)&g_async.slot[i].data,4096,ASYNC_SLOT_SIZE) != 0)
+        Error("Unable to allocate the output buffers\n",-1);
+    if(pthread_create(&g_async.thread,NULL,Async_Writer,NULL) != 0)
+      Error("Unable to start the output thread\n",-1);
+    g_async.running = 1;
+  }
+  pthread_mutex_lock(&g_async.lock);
+  g_async.audio_name = audio_name;
+  g_async.filename = filename;
+  g_async.splice = 0;
+#if defined(OUTPUT_RAW) || defined(OUTPUT_WAV)
+  /* Async_Close() left the ring idle,so it is safe to change the sink */
+  if((fstat(g_outfile.fd,&st) == 0) && S_ISFIFO(st.st_mode) &&
+     (ioctl(g_outfile.fd,FIONREAD,&unread) == 0)) {
+    (void) fcntl(g_outfile.fd,F_SETPIPE_SZ,ASYNC_SLOT_SIZE);
+    g_async.splice = 1;
+  }
+#endif
+  Async_Wait(ASYNC_SLOTS - 1);
+  g_async.slot[g_async.filled % ASYNC_SLOTS].len = 0;
+  pthread_mutex_unlock(&g_async.lock);
+  *size = ASYNC_SLOT_SIZE;
+  return(g_async.slot[g_async.filled % ASYNC_SLOTS].data);
+}
+
+static void Async_Submit(void){
+  pthread_mutex_lock(&g_async.lock);
+  g_async.filled++;
+  pthread_cond_broadcast(&g_async.cond);
+  Async_Wait(ASYNC_SLOTS - 1);
+  g_async.slot[g_async.filled % ASYNC_SLOTS].len = 0;
+  pthread_mutex_unlock(&g_async.lock);
+}
+
+/**Description: hands decoded data over to the writer thread.
+* Parameters: Stream handle,number of bytes decoded into the last returned
+              buffer,pointer to return the size of the next buffer.
+* Return value: Buffer to decode into next.
+**/
+static unsigned char *Async_Commit(pdmp3_handle *id,size_t nbytes,size_t *size){
+  t_async_slot *s = &g_async.slot[g_async.filled % ASYNC_SLOTS];
+
+  if(nbytes) {
+    if(s->len && (s->rate != g_sampling_frequency[id->g_frame_header.sampling_frequency])) {
+      Async_Submit(); /* A slot holds one format only */
+      memmove(g_async.slot[g_async.filled % ASYNC_SLOTS].data,s->data + s->len,nbytes);
+      s = &g_async.slot[g_async.filled % ASYNC_SLOTS];
+    }
+    s->rate = g_sampling_frequency[id->g_frame_header.sampling_frequency];
+    s->nch = (id->g_frame_header.mode == mpeg1_mode_single_channel ? 1 : 2);
+    s->len += nbytes;
+  }
+  if(s->len == ASYNC_SLOT_SIZE) {
+    Async_Submit();
+    s = &g_async.slot[g_async.filled % ASYNC_SLOTS];
+  }
+  *size = ASYNC_SLOT_SIZE - s->len;
+  return(s->data + s->len);
+}
+
+/**Description: submits the last partial slot and waits until the writer
+                thread has passed everything on to the sink. A pipe that
+                was spliced to has to be read up to the last slot too,as
+                the next file's sink may not be a pipe and would reuse the
+                slots straight away.
+* Parameters: None
+* Return value: None
+**/
+static void Async_Close(void){
+  pthread_mutex_lock(&g_async.lock);
+  if(g_async.slot[g_async.filled % ASYNC_SLOTS].len) {
+    g_async.filled++;
+    pthread_cond_broadcast(&g_async.cond);
+  }
+  while(g_async.written != g_async.filled)
+    pthread_cond_wait(&g_async.cond,&g_async.lock);
+  if(g_async.splice) Async_Wait(0);
+  pthread_mutex_unlock(&g_async.lock);
+}
+
+static void Async_Stop(void){
+  if(!g_async.running) return;
+  pthread_mutex_lock(&g_async.lock);
+  g_async.stop = 1;
+  pthread_cond_broadcast(&g_async.cond);
+  pthread_mutex_unlock(&g_async.lock);
+  pthread_join(g_async.thread,NULL);
+  g_async.running = 0;
+}
+#endif /* OUTPUT_ASYNC */
+
+
+/**Description: copies MP3 data into an input ring buffer.
+* Parameters: Ring buffer,read position,pointer to the write position,data
+              buffer containing MP3 data,size of the data buffer.
+* Return value: PDMP3_OK or PDMP3_NO_SPACE
+* Author: Erik Hofman(erik@ehofman.com) **/
+static int Inbuf_Write(unsigned char *ring,unsigned istart,unsigned *iend,const unsigned char *in,size_t size){
+  int free = (*iend<istart)?(istart-*iend):(INBUF_SIZE-*iend+istart);
+  if(size<=free)
+  {
+    int res;
+    if(*iend<istart)
+    {
+       res = istart-*iend;
+       if(size<res) res=size;
+       memcpy(ring+*iend,in,res);
+       *iend += res;
+    }
+    else
+    {
+       res = INBUF_SIZE-*iend;
+       if(size<res) res=size;
+       if(res) {
+          memcpy(ring+*iend,in,res);
+          *iend += res;
+          size-= res;
+       }
+       if(size) {
+          memcpy(ring,in+res,size);
+          *iend = size;
+       }
+    }
+    return(PDMP3_OK);
+  }
+  return(PDMP3_NO_SPACE);
+}
+
+/**Description: checks whether the next frame is completely buffered. Looks
+                for the first header Search_Header() would accept and takes
+                the frame size from it,so a frame is read as soon as its last
+                byte arrives,whatever the bitrate. The scan resumes where the
+                last call left it as long as no input was consumed,and once
+                the header is settled only the buffered bytes are counted,so
+                feeding in small pieces doesn't look at a byte twice. A header
+                waiting for the headers that confirm it holds the scan there.
+                Junk is handed to Search_Header() once it holds as many sync
+                words as that gives up after.
+* Parameters: Stream handle.
+* Return value: PDMP3_OK or PDMP3_NEED_MORE.
+**/
+static int Frame_Ready(pdmp3_handle *id){
+  unsigned filled = Get_Inbuf_Filled(id);
+  unsigned pos,header,framesize,i;
+  int res;
+
+  if((id->frame_pos != id->processed) ||(id->frame_istart != id->istart)) {
+    id->frame_pos = id->processed;
+    id->frame_istart = id->istart;
+    id->frame_scan = 0;
+    id->frame_word = 0;
+    id->frame_syncs = 0;
+    id->frame_need = 0;
+  }
+  if(id->frame_need) return((filled >= id->frame_need) ? PDMP3_OK : PDMP3_NEED_MORE);
+  if(id->frame_syncs > 2*576) return(PDMP3_OK); /* Search_Header() gives up */
+  id->frame_at = ~0u;
+  pos =(id->istart + id->frame_scan) % INBUF_SIZE;
+  header = id->frame_word;
+  for(i = id->frame_scan; i < filled; i++) {
+    header =(header << 8) | id->in[pos];
+    if(++pos == INBUF_SIZE) pos = 0;
+    if((i < 3) ||((header & 0xfff00000) != C_SYNC)) continue;
+    /* A sync word starts i-3 bytes into the buffered data */
+    res = PDMP3_ERR;
+    if((framesize = Header_Frame_Size(header)) != 0) {
+      res = PDMP3_OK;
+      if(i > 3) /* Bytes were skipped */
+        res = Check_Frame_Chain(id,id->istart,(pos + INBUF_SIZE - 4) % INBUF_SIZE);
+    }
+    if(res == PDMP3_ERR) {
+      if(++id->frame_syncs > 2*576) { /* Search_Header() gives up here */
+        id->frame_scan = i + 1;
+        id->frame_word = header;
+        return(PDMP3_OK);
+      }
+      continue;
+    }
+    if(res == PDMP3_NEED_MORE) { /* The chain isn't buffered yet,look at this header again */
+      id->frame_scan = i;
+      id->frame_word = header >> 8;
+      return(PDMP3_NEED_MORE);
+    }
+    id->frame_at = i - 3;
+    id->frame_need = i - 3 + framesize; /* Settled */
+    return((filled >= id->frame_need) ? PDMP3_OK : PDMP3_NEED_MORE);
+  }
+  id->frame_scan = i;
+  id->frame_word = header;
+  /* No header yet. Search_Header() finds none in the buffered data either,
+   * let it once no more input fits or comes */
+  return(((filled >= (2*576 + 4)) &&((filled >= INBUF_SIZE - 1) || id->input_end)) ?
+         PDMP3_OK : PDMP3_NEED_MORE);
+}
+
+/**Description: parses the first header of a stream without consuming any
+                input,for pdmp3_decode() without an output buffer. Finds it
+                through Frame_Ready(),so repeated calls while the stream
+                trickles in don't search the buffered data again.
+* Parameters: Stream handle.
+* Return value: PDMP3_OK,PDMP3_NEW_FORMAT,PDMP3_NEED_MORE,or PDMP3_ERR if
+                no header was found among 2*576 sync words.
+**/
+static int Probe_Header(pdmp3_handle *id){
+  size_t pos = id->processed;
+  unsigned mark = id->istart;
+  int res;
+
+  res = Frame_Ready(id);
+  if(id->frame_at == ~0u) return((res == PDMP3_OK) ? PDMP3_ERR : PDMP3_NEED_MORE);
+  id->istart =(mark + id->frame_at) % INBUF_SIZE;
+  res = Read_Header(id);
+  id->processed = pos;
+  id->istart = mark;
+  if(id->new_header == 1) res = PDMP3_NEW_FORMAT;
+  return(res);
+}
+
+/**Description: reads the next frame once it is completely buffered. The input
+                position is restored if the frame can't be read.
+* Parameters: Stream handle.
+* Return value: Read_Frame() result,or PDMP3_NEED_MORE.
+**/
+static int Read_Next_Frame(pdmp3_handle *id){
+  size_t pos = id->processed;
+  unsigned mark = id->istart;
+  int res;
+
+  if(Frame_Ready(id) != PDMP3_OK) return(PDMP3_NEED_MORE);
+  while((res = Read_Frame(id)) == PDMP3_NEED_MORE) {
+    /* The bit reservoir lacks main_data_begin bytes,which no amount of input
+     * will fix. The frame's main data is in the reservoir now,go on with the
+     * next frame instead of reading this one again. */
+    pos = id->processed;
+    mark = id->istart;
+    if(Frame_Ready(id) != PDMP3_OK) return(PDMP3_NEED_MORE);
+  }
+  if(res != PDMP3_OK && res != PDMP3_NEW_FORMAT) {
+    id->processed = pos;
+    id->istart = mark;
+  }
+  return(res);
+}
+
+/**Description: drops bytes from the input buffer.
+* Parameters: Stream handle,number of bytes(no more than are buffered).
+* Return value: None
+**/
+static void Skip_Bytes(pdmp3_handle *id,unsigned no_of_bytes){
+  id->istart =(id->istart + no_of_bytes) % INBUF_SIZE;
+  id->processed += no_of_bytes;
+}
+
+#define SKIP_PRIME 10 /* Frames before decoding resumes whose main data is parsed */
+
+/**Description: passes over the next frame without decoding it,keeping the
+                bit reservoir accounting of Get_Main_Data(). With 'prime' the
+                main data is read into the reservoir and parsed,as granules
+                can reuse scalefactors of earlier frames. Otherwise only its
+                size is booked,which leaves stale bytes in the reservoir that
+                511 bytes of primed main data flush out again.
+* Parameters: Stream handle,nonzero to read the main data.
+* Return value: PDMP3_OK,PDMP3_NEED_MORE if Read_Frame() would skip the frame
+                for lack of reservoir data,or PDMP3_ERR.
+**/
+static int Skip_Frame(pdmp3_handle *id,int prime){
+  unsigned framesize,main_data_size,begin;
+
+  if(Search_Header(id) != PDMP3_OK) return(PDMP3_ERR);
+  if((id->g_frame_header.protection_bit==0)&&(Read_CRC(id)!=PDMP3_OK)) return(PDMP3_ERR);
+  if(Read_Audio_L3(id) != PDMP3_OK) return(PDMP3_ERR);
+  if(prime) return(Read_Main_L3(id));
+  framesize =(144 *
+    g_mpeg1_bitrates[id->g_frame_header.layer-1][id->g_frame_header.bitrate_index]) /
+    g_sampling_frequency[id->g_frame_header.sampling_frequency] +
+    id->g_frame_header.padding_bit;
+  main_data_size = framesize -
+   (id->g_frame_header.mode == mpeg1_mode_single_channel ? 17 : 32) - 4;
+  if(id->g_frame_header.protection_bit == 0) main_data_size -= 2;
+  Skip_Bytes(id,main_data_size);
+  begin = id->g_side_info.main_data_begin;
+  if(begin > id->g_main_data_top) {
+    id->g_main_data_top += main_data_size;
+    id->stats.underflows++;
+    return(PDMP3_NEED_MORE);
+  }
+  id->g_main_data_top =((id->g_main_data_top < 511) ? id->g_main_data_top : 511) +
+    main_data_size;
+  return(PDMP3_OK);
+}
+
+#ifdef PDMP3_PIPELINE
+/* Pipelined decoding: a parser thread per handle runs Read_Frame() (header,
+ * side info,scalefactors and Huffman decoding) ahead of pdmp3_read(),which
+ * only does the DSP work. The parser owns the input buffer and the bit
+ * reservoir in 'parse' and hands frames over through a single producer,
+ * single consumer ring of frame records. The ring indices,the input buffer
+ * positions and the feed counter are atomics; the mutex only guards going
+ * to sleep. */
+#define PIPELINE_FRAMES 4 /* Frames parsed ahead */
+
+typedef struct {
+  int res;                      /* Read_Frame() result */
+  t_mpeg1_header header;
+  t_mpeg1_side_info side_info;
+  t_mpeg1_main_data main_data;  /* Scalefactors and Huffman decoded spectra */
+}
+t_frame_rec;
+
+struct pdmp3_pipeline {
+  pdmp3_handle parse;           /* Parser state,owned by the parser thread */
+  t_frame_rec rec[PIPELINE_FRAMES];
+  unsigned head,tail;           /* Records produced,consumed */
+  unsigned istart,iend;         /* Input consumed by the parser,fed */
+  unsigned fed;                 /* Number of pdmp3_feed() calls */
+  unsigned ended;               /* pdmp3_feed_end() was called */
+  unsigned idle;                /* fed+1 once the parser waits for input */
+  unsigned waiters;
+  int stop,running;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+#define PIPE_LOAD(x)     __atomic_load_n(&(x),__ATOMIC_SEQ_CST)
+#define PIPE_STORE(x,v)  __atomic_store_n(&(x),(v),__ATOMIC_SEQ_CST)
+
+/**Description: wakes the other stage if it is waiting.
+* Parameters: Pipeline.
+* Return value: None
+**/
+static void Pipeline_Wake(struct pdmp3_pipeline *p){
+  if(PIPE_LOAD(p->waiters)) {
+    pthread_mutex_lock(&p->lock);
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+  }
+}
+
+#define PIPELINE_WAIT(p,cond_) do { pthread_mutex_lock(&(p)->lock);      \
+    PIPE_STORE((p)->waiters,PIPE_LOAD((p)->waiters) + 1);                \
+    while(cond_) pthread_cond_wait(&(p)->cond,&(p)->lock);               \
+    PIPE_STORE((p)->waiters,PIPE_LOAD((p)->waiters) - 1);                \
+    pthread_mutex_unlock(&(p)->lock); } while(0)
+
+static void *Pipeline_Parse(void *arg){
+  struct pdmp3_pipeline *p = arg;
+  pdmp3_handle *ph = &p->parse;
+  t_frame_rec *rec;
+  unsigned fed;
+  int res;
+
+  for(;;) {
+    PIPELINE_WAIT(p,!PIPE_LOAD(p->stop) &&
+                  (p->head - PIPE_LOAD(p->tail) == PIPELINE_FRAMES));
+    if(PIPE_LOAD(p->stop)) break;
+    fed = PIPE_LOAD(p->fed);
+    ph->iend = PIPE_LOAD(p->iend);
+    ph->input_end = PIPE_LOAD(p->ended);
+    res = Read_Next_Frame(ph);
+    if(res != PDMP3_NEED_MORE) {
+      rec = &p->rec[p->head % PIPELINE_FRAMES];
+      rec->res = res;
+      if(res != PDMP3_ERR) {
+        rec->header = ph->g_frame_header;
+        rec->side_info = ph->g_side_info;
+        rec->main_data = ph->g_main_data;
+      }
+      PIPE_STORE(p->istart,ph->istart);
+      PIPE_STORE(p->head,p->head + 1);
+      Pipeline_Wake(p);
+      if(res != PDMP3_ERR) continue;
+    }
+    /* Nothing to parse until more data is fed */
+    PIPE_STORE(p->idle,fed + 1);
+    Pipeline_Wake(p);
+    PIPELINE_WAIT(p,!PIPE_LOAD(p->stop) && (PIPE_LOAD(p->fed) == fed));
+    PIPE_STORE(p->idle,0);
+  }
+  return(NULL);
+}
+
+static void Pipeline_Stop(struct pdmp3_pipeline *p){
+  if(!p->running) return;
+  PIPE_STORE(p->stop,1);
+  pthread_mutex_lock(&p->lock);
+  pthread_cond_broadcast(&p->cond);
+  pthread_mutex_unlock(&p->lock);
+  pthread_join(p->thread,NULL);
+  p->running = 0;
+  p->stop = 0;
+}
+
+/**Description: stops the parser and resets the pipeline for a new stream.
+* Parameters: Pipeline.
+* Return value: None
+**/
+static void Pipeline_Reset(struct pdmp3_pipeline *p){
+  Pipeline_Stop(p);
+  p->head = p->tail = 0;
+  p->istart = p->iend = 0;
+  p->fed = 0;
+  p->ended = 0;
+  p->idle = 0;
+  pdmp3_open_feed(&p->parse);
+}
+
+static unsigned Pipeline_Inbuf_Free(struct pdmp3_pipeline *p){
+  unsigned istart = PIPE_LOAD(p->istart);
+  return (p->iend<istart)?(istart-p->iend):(INBUF_SIZE-p->iend+istart);
+}
+
+static int Pipeline_Feed(struct pdmp3_pipeline *p,const unsigned char *in,size_t size){
+  unsigned iend = p->iend;
+  int res;
+
+  res = Inbuf_Write(p->parse.in,PIPE_LOAD(p->istart),&iend,in,size);
+  if(res == PDMP3_OK) {
+    PIPE_STORE(p->iend,iend);
+    PIPE_STORE(p->fed,p->fed + 1);
+    Pipeline_Wake(p);
+  }
+  return(res);
+}
+
+static void Pipeline_Feed_End(struct pdmp3_pipeline *p){
+  PIPE_STORE(p->ended,1);
+  PIPE_STORE(p->fed,p->fed + 1); /* The parser looks again */
+  Pipeline_Wake(p);
+}
+
+/**Description: takes the next parsed frame from the pipeline,starting the
+                parser thread if needed.
+* Parameters: Stream handle.
+* Return value: Read_Frame() result,or PDMP3_NEED_MORE once the parser has
+                consumed all data fed so far.
+**/
+static int Pipeline_Next_Frame(pdmp3_handle *id){
+  struct pdmp3_pipeline *p = id->pipeline;
+  t_frame_rec *rec;
+  int res;
+
+  if(!p->running) {
+    if(pthread_create(&p->thread,NULL,Pipeline_Parse,p) != 0) return(PDMP3_ERR);
+    p->running = 1;
+  }
+  /* The idle mark is checked before the ring,as records are published first */
+  PIPELINE_WAIT(p,(PIPE_LOAD(p->idle) != p->fed + 1) &&
+                  (PIPE_LOAD(p->head) == p->tail));
+  if(PIPE_LOAD(p->head) == p->tail) return(PDMP3_NEED_MORE);
+  rec = &p->rec[p->tail % PIPELINE_FRAMES];
+  res = rec->res;
+  if(res != PDMP3_ERR) {
+    id->g_frame_header = rec->header;
+    id->g_side_info = rec->side_info;
+    id->g_main_data = rec->main_data;
+    id->dirty |= HANDLE_DIRTY_SCALEFAC; /* The parser's scalefactors */
+    if(!id->new_header) id->new_header = 1;
+  }
+  PIPE_STORE(p->tail,p->tail + 1);
+  Pipeline_Wake(p);
+  return(res);
+}
+
+/**Description: looks for the first header before the parser thread is
+                started,for pdmp3_decode() without an output buffer.
+* Parameters: Stream handle.
+* Return value: Probe_Header() result.
+**/
+static int Pipeline_Probe(pdmp3_handle *id){
+  pdmp3_handle *ph = &id->pipeline->parse;
+  int res;
+
+  ph->iend = id->pipeline->iend;
+  ph->input_end = id->pipeline->ended;
+  res = Probe_Header(ph);
+  id->g_frame_header = ph->g_frame_header;
+  if(ph->new_header && !id->new_header) id->new_header = 1;
+  if(id->new_header == 1) res = PDMP3_NEW_FORMAT;
+  return(res);
+}
+#endif /* PDMP3_PIPELINE */
+
+/**Description: takes the next frame to decode from the parser thread or the
+                input buffer,and counts it.
+* Parameters: Stream handle.
+* Return value: Read_Frame() result,or PDMP3_NEED_MORE.
+**/
+static int Next_Frame(pdmp3_handle *id){
+  int res;
+
+#ifdef PDMP3_PIPELINE
+  res = Pipeline_Next_Frame(id);
+#else
+  res = Read_Next_Frame(id);
+#endif
+  if(res == PDMP3_OK || res == PDMP3_NEW_FORMAT) id->frame_num++;
+  return(res);
+}
+
+/*#############################################################################
+ * Stream API - Added for AeonWave Audio (http://www.adalin.com)
  * This is a subset of the libmpg123 API and should by 100% compatible.
  *
  * Au0thor: Erik Hofman(erik@ehofman.com)
  */
+/* Samples that aren't synthesized straight into the caller's buffer wait in
+ * is[],which isn't needed again before the next frame is read. Granule 1 only
+ * uses is[1],so is[0] can hold the samples of the whole frame */
+#define OUT_STAGE(id) ((int16_t *)(id)->g_main_data.is)
+
+/**Description: decodes granules of the frame read last into OUT_STAGE(id).
+* Parameters: Stream handle,first granule,number of granules(1 or 2).
+* Return value: None
+**/
+static void Decode_L3_Stage(pdmp3_handle *id,unsigned gr,unsigned ngr){
+  int16_t pcm[576*2]; /* Granule 0 reads is[0] while it is synthesized */
+  unsigned nch;
+
+  if(gr == 1) { /* is[0] is done with */
+    Decode_L3_Granule(id,1,OUT_STAGE(id));
+    return;
+  }
+  nch =(id->g_frame_header.mode == mpeg1_mode_single_channel ? 1 : 2);
+  Decode_L3_Granule(id,0,pcm);
+  if(ngr == 2) Decode_L3_Granule(id,1,OUT_STAGE(id) + 576*nch);
+  memcpy(OUT_STAGE(id),pcm,576*nch*sizeof(int16_t));
+}
+
 static void Convert_Frame_S16(pdmp3_handle *id,unsigned char *outbuf,size_t buflen,size_t *done)
 {
-  short *s = (short *)outbuf;
-  unsigned lo,hi,nsamps,framesz;
-  int q,i,nch,gr;
+  unsigned nsamps,framesz;
+  int nch;
 
   nch = (id->g_frame_header.mode == mpeg1_mode_single_channel ? 1 : 2);
-  framesz = sizeof(short)*nch;
+  framesz = sizeof(int16_t)*nch;
 
   nsamps = buflen / framesz;
-  if (nsamps > (2*576 - id->ostart)) {
-    nsamps = 2*576 - id->ostart;
+  if (nsamps > (id->olen - id->ostart)) {
+    nsamps = id->olen - id->ostart;
   }
   *done = nsamps * framesz;
 
   /* copy to outbuf */
-  i = id->ostart % 576;
-  gr = id->ostart/576;
-  for (q = 0; q < nsamps; ++q) {
-    if(nch == 1) {
-      lo = id->out[gr][i] & 0xffff;
-      s[q] = lo;
-    } else {
-      lo = id->out[gr][i] & 0xffff;
-      hi =(id->out[gr][i] & 0xffff0000) >> 16;
-      s[2*q] = hi;
-      s[2*q+1] = lo;
-    }
-    if (++i == 576) {
-       ++gr;
-       i = 0;
-    }
-  }
+  memcpy(outbuf,OUT_STAGE(id) + id->ostart*nch,*done);
 
   id->ostart += nsamps;
-  if (id->ostart == (2*576)) {
+  if (id->ostart == id->olen) {
     id->ostart = 0;
   }
 }
 
+/* Handle sizes are rounded up to whole cache lines */
+#define HANDLE_ROUND(n) (((n) + PDMP3_HANDLE_ALIGN - 1) & ~(size_t)(PDMP3_HANDLE_ALIGN - 1))
+
+static void *Handle_Alloc(void *ctx,size_t size,size_t align){
+  void *mem;
+
+  if(posix_memalign(&mem,align,size) != 0) return(NULL);
+  return(mem);
+}
+
+static void Handle_Free(void *ctx,void *mem){
+  free(mem);
+}
+
 /**Description: Create a new streaming handle
-* Parameters: None
-* Return value: Stream handle
+* Parameters: Decoder name(ignored),a pointer to return PDMP3_OK or an error
+              or NULL.
+* Return value: Stream handle,ready for pdmp3_feed(),or NULL
 * Author: Erik Hofman(erik@ehofman.com) **/
 pdmp3_handle* pdmp3_new(const char *decoder,int *error){
-  return malloc(sizeof(pdmp3_handle));
+  return(pdmp3_new_with_allocator(Handle_Alloc,Handle_Free,NULL,error));
+}
+
+/**Description: Create a new streaming handle in memory from the caller's
+                allocator. pdmp3_delete() hands it back to 'release'.
+* Parameters: Allocator called once with the context,the size and the
+              alignment of pdmp3_get_handle_requirements(),the matching
+              free function,their context,a pointer to return PDMP3_OK or
+              an error or NULL.
+* Return value: Stream handle,ready for pdmp3_feed(),or NULL
+**/
+pdmp3_handle *pdmp3_new_with_allocator(pdmp3_alloc_fn alloc,pdmp3_free_fn release,void *ctx,int *error){
+  size_t size = pdmp3_handle_size();
+  pdmp3_handle *id;
+  void *mem;
+
+  if(!alloc || !release ||(mem = alloc(ctx,size,PDMP3_HANDLE_ALIGN)) == NULL) {
+    if(error) *error = PDMP3_ERR;
+    return(NULL);
+  }
+  id = pdmp3_init_handle(mem,size,error);
+  if(!id) {
+    release(ctx,mem);
+    return(NULL);
+  }
+  id->release = release;
+  id->alloc_ctx = ctx;
+  return(id);
+}
+
+/**Description: Initialize a streaming handle in caller memory. The memory
+                isn't touched by the decoder after pdmp3_delete().
+* Parameters: Memory of at least the size and alignment reported by
+              pdmp3_get_handle_requirements(),its size,a pointer to return
+              PDMP3_OK or an error or NULL.
+* Return value: Stream handle,ready for pdmp3_feed(),or NULL if the memory
+                is misaligned(PDMP3_ERR) or too small(PDMP3_NO_SPACE).
+**/
+pdmp3_handle *pdmp3_init_handle(void *mem,size_t size,int *error){
+  pdmp3_handle *id = mem;
+  int res = PDMP3_OK;
+
+  if(!mem ||((uintptr_t) mem % PDMP3_HANDLE_ALIGN)) res = PDMP3_ERR;
+  else if(size < pdmp3_handle_size()) res = PDMP3_NO_SPACE;
+  if(error) *error = res;
+  if(res != PDMP3_OK) return(NULL);
+
+#ifdef PDMP3_PIPELINE
+  id->pipeline = (struct pdmp3_pipeline *)((char *) mem + HANDLE_ROUND(sizeof(pdmp3_handle)));
+  memset(id->pipeline,0,sizeof(struct pdmp3_pipeline));
+  pthread_mutex_init(&id->pipeline->lock,NULL);
+  pthread_cond_init(&id->pipeline->cond,NULL);
+#endif
+  id->release = NULL;
+  id->alloc_ctx = NULL;
+  id->dirty = HANDLE_DIRTY_SYNTH | HANDLE_DIRTY_SCALEFAC; /* Fresh memory */
+  id->generation = 0;
+  id->granule_output = 0;
+  pdmp3_open_feed(id);
+  return(id);
+}
+
+/**Description: Memory used by one streaming handle,for sizing large numbers
+                of concurrent streams.
+* Parameters: None
+* Return value: Bytes allocated by pdmp3_new()
+**/
+size_t pdmp3_handle_size(void){
+#ifdef PDMP3_PIPELINE
+  return(HANDLE_ROUND(sizeof(pdmp3_handle)) + HANDLE_ROUND(sizeof(struct pdmp3_pipeline)));
+#else
+  return(HANDLE_ROUND(sizeof(pdmp3_handle)));
+#endif
+}
+
+/**Description: Memory needed for pdmp3_init_handle().
+* Parameters: Pointers to return the size and the alignment in bytes.
+* Return value: PDMP3_OK or PDMP3_ERR
+**/
+int pdmp3_get_handle_requirements(size_t *size,size_t *align){
+  if(size && align) {
+    *size = pdmp3_handle_size();
+    *align = PDMP3_HANDLE_ALIGN;
+    return(PDMP3_OK);
+  }
+  return(PDMP3_ERR);
 }
 
 
-/**Description: Free a streaming handle
+/**Description: Free a streaming handle,or release one in caller memory.
 * Parameters: Streaming handle
 * Return value: None
 * Author: Erik Hofman(erik@ehofman.com) **/
 void pdmp3_delete(pdmp3_handle *id){
-  free(id);
+  if(id) {
+#ifdef PDMP3_PIPELINE
+    Pipeline_Stop(id->pipeline);
+    pthread_mutex_destroy(&id->pipeline->lock);
+    pthread_cond_destroy(&id->pipeline->cond);
+#endif
+    if(id->release) id->release(id->alloc_ctx,id);
+  }
 }
 
+#define POOL_MAX 64 /* Free handles kept per thread */
+
+static __thread pdmp3_handle *g_pool; /* Free handles of the calling thread */
+static __thread unsigned g_pool_free;
+static pthread_key_t g_pool_key;       /* Drains the pool at thread exit */
+static pthread_once_t g_pool_once = PTHREAD_ONCE_INIT;
+
+static void Pool_Exit(void *arg){
+  (void) arg; /* The pool is found through g_pool */
+  pdmp3_pool_drain();
+}
 
-/**Description: Resets the stream handle.
+static void Pool_Key_Init(void){
+  pthread_key_create(&g_pool_key,Pool_Exit);
+}
+
+/**Description: Take a handle from the calling thread's pool,or create one
+                if the pool is empty.
+* Parameters: A pointer to return PDMP3_OK or an error or NULL.
+* Return value: Stream handle,ready for pdmp3_feed(),or NULL
+**/
+pdmp3_handle *pdmp3_pool_get(int *error){
+  pdmp3_handle *id = g_pool;
+
+  if(!id) return(pdmp3_new(NULL,error));
+  g_pool = id->pool_next;
+  g_pool_free--;
+  if(error) *error = PDMP3_OK;
+  return(id);
+}
+
+/**Description: Reset a handle and keep it in the calling thread's pool for
+                pdmp3_pool_get(). Handles beyond POOL_MAX are deleted.
+* Parameters: Stream handle
+* Return value: None
+**/
+void pdmp3_pool_put(pdmp3_handle *id){
+  if(!id) return;
+  if(g_pool_free == POOL_MAX) {
+    pdmp3_delete(id);
+    return;
+  }
+  if(!g_pool) {
+    pthread_once(&g_pool_once,Pool_Key_Init);
+    pthread_setspecific(g_pool_key,id);
+  }
+  pdmp3_open_feed(id);
+  id->granule_output = 0;
+  id->pool_next = g_pool;
+  g_pool = id;
+  g_pool_free++;
+}
+
+/**Description: Delete the handles in the calling thread's pool. Done
+                automatically when the thread exits.
+* Parameters: None
+* Return value: None
+**/
+void pdmp3_pool_drain(void){
+  pdmp3_handle *id;
+
+  while((id = g_pool) != NULL) {
+    g_pool = id->pool_next;
+    pdmp3_delete(id);
+  }
+  g_pool_free = 0;
+}
+
+
+/**Description: Resets the stream handle. Only the state touched since the
+                last reset is cleared,so reusing a handle for a short clip
+                costs about as much as the clip.
 * Parameters: Stream handle
 * Return value: PDMP3_OK or PDMP3_ERR
 * Author: Erik Hofman(erik@ehofman.com) **/
 int pdmp3_open_feed(pdmp3_handle *id){
   if(id) {
     id->ostart = 0;
+    id->granule_next = 0;
+    id->frame_num = 0;
     id->istart = 0;
     id->iend = 0;
     id->processed = 0;
     id->new_header = 0;
+    id->input_end = 0;
+    id->frame_istart = ~0u; /* Frame_Ready() starts over */
 
-    id->hsynth_init = 1;
-    id->synth_init = 1;
     id->g_main_data_top = 0;
+    id->g_main_data_end = RES_KEEP;
+    if(id->dirty & HANDLE_DIRTY_SYNTH) {
+      memset(id->store,0,sizeof(id->store));
+      memset(id->v_vec,0,sizeof(id->v_vec));
+    }
+    /* scfsi may reuse scalefactors of a granule that didn't send them */
+    if(id->dirty & HANDLE_DIRTY_SCALEFAC) {
+      memset(id->g_main_data.scalefac_l,0,sizeof(id->g_main_data.scalefac_l));
+      memset(id->g_main_data.scalefac_s,0,sizeof(id->g_main_data.scalefac_s));
+    }
+    id->dirty = 0;
+    id->generation++;
+    memset(&id->stats,0,sizeof(id->stats));
+#ifdef PDMP3_STAGE_STATS
+    memset(&id->stage_stats,0,sizeof(id->stage_stats));
+#endif
+#ifdef PDMP3_PIPELINE
+    if(id->pipeline) Pipeline_Reset(id->pipeline);
+#endif
 
     return(PDMP3_OK);
   }
@@ -2390,34 +3943,33 @@ int pdmp3_open_feed(pdmp3_handle *id){
 * Author: Erik Hofman(erik@ehofman.com) **/
 int pdmp3_feed(pdmp3_handle *id,const unsigned char *in,size_t size){
   if(id && in && size) {
-    int free = Get_Inbuf_Free(id);
-    if(size<=free)
-    {
-      int res;
-      if(id->iend<id->istart)
-      {
-         res = id->istart-id->iend;
-         if(size<res) res=size;
-         memcpy(id->in+id->iend,in,res);
-         id->iend += res;
-      }
-      else
-      {
-         res = INBUF_SIZE-id->iend;
-         if(size<res) res=size;
-         if(res) {
-            memcpy(id->in+id->iend,in,res);
-            id->iend += res;
-            size-= res;
-         }
-         if(size) {
-            memcpy(id->in,in+res,size);
-            id->iend = size;
-         }
-      }
-      return(PDMP3_OK);
-    }
-    return(PDMP3_NO_SPACE);
+    int res;
+#ifdef PDMP3_PIPELINE
+    res = Pipeline_Feed(id->pipeline,in,size);
+#else
+    res = Inbuf_Write(id->in,id->istart,&id->iend,in,size);
+#endif
+    if(res == PDMP3_NO_SPACE) id->stats.feed_no_space++;
+    return(res);
+  }
+  return(PDMP3_ERR);
+}
+
+/**Description: Tells the decoder that nothing follows the data fed so far,
+                until pdmp3_open_feed() starts a new stream. A header found
+                after junk is then taken without the headers after it that
+                would confirm it.
+* Parameters: Stream handle
+* Return value: PDMP3_OK or PDMP3_ERR
+**/
+int pdmp3_feed_end(pdmp3_handle *id){
+  if(id) {
+#ifdef PDMP3_PIPELINE
+    Pipeline_Feed_End(id->pipeline);
+#else
+    id->input_end = 1;
+#endif
+    return(PDMP3_OK);
   }
   return(PDMP3_ERR);
 }
@@ -2442,30 +3994,36 @@ int pdmp3_read(pdmp3_handle *id,unsigned char *outmemory,size_t outsize,size_t *
       }
 
       while(outsize) {
-        if (Get_Inbuf_Filled(id) >= (2*576)) {
-          size_t pos = id->processed;
-          unsigned mark = id->istart;
-
-          res = Read_Frame(id);
-          if(res == PDMP3_OK || res == PDMP3_NEW_FORMAT) {
-            size_t batch;
-
-            Decode_L3(id);
-            Convert_Frame_S16(id,outmemory,outsize,&batch);
-            outmemory += batch;
-            outsize -= batch;
-            *done += batch;
-          }
-          else {
-            id->processed = pos;
-            id->istart = mark;
-            break;
+        unsigned gr = 0,ngr = 2,nch;
+        size_t batch;
+
+        if(id->granule_next) { /* The rest of the last frame read */
+          gr = 1;
+          ngr = 1;
+          id->granule_next = 0;
+          res = PDMP3_OK;
+        }else{
+          res = Next_Frame(id);
+          if(res != PDMP3_OK && res != PDMP3_NEW_FORMAT) break;
+          if(id->granule_output) {
+            ngr = 1;
+            id->granule_next = 1;
           }
         }
-        else {
-          res = PDMP3_NEED_MORE;
-          break;
+        nch =(id->g_frame_header.mode == mpeg1_mode_single_channel ? 1 : 2);
+        batch = ngr*576*sizeof(int16_t)*nch;
+        /* Synthesize straight into the caller's buffer if it holds int16_t */
+        if((outsize >= batch) && !((uintptr_t) outmemory % sizeof(int16_t))) {
+          if(ngr == 2) Decode_L3(id,(int16_t *)outmemory);
+          else Decode_L3_Granule(id,gr,(int16_t *)outmemory);
+        }else{ /* Keep what doesn't fit in the handle,or copy it */
+          Decode_L3_Stage(id,gr,ngr);
+          id->olen = ngr*576;
+          Convert_Frame_S16(id,outmemory,outsize,&batch);
         }
+        outmemory += batch;
+        outsize -= batch;
+        *done += batch;
       } /* outsize */
       if(id->new_header == 1 && res == PDMP3_OK) {
         res = PDMP3_NEW_FORMAT;
@@ -2490,7 +4048,11 @@ int pdmp3_read(pdmp3_handle *id,unsigned char *outmemory,size_t outsize,size_t *
 * Author: Erik Hofman(erik@ehofman.com) **/
 int pdmp3_decode(pdmp3_handle *id,const unsigned char *in,size_t insize,unsigned char *out,size_t outsize,size_t *done)
 {
+#ifdef PDMP3_PIPELINE
+  int free = Pipeline_Inbuf_Free(id->pipeline);
+#else
   int free = Get_Inbuf_Free(id);
+#endif
   int res;
 
   *done = 0;
@@ -2504,17 +4066,15 @@ int pdmp3_decode(pdmp3_handle *id,const unsigned char *in,size_t insize,unsigned
       res = pdmp3_read(id,out,outsize,&avail);
       *done = avail;
     }
+#ifdef PDMP3_PIPELINE
+    else if(!id->pipeline->running && Get_Filepos(&id->pipeline->parse) == 0) {
+      res = Pipeline_Probe(id);
+    }
+#else
     else if(Get_Filepos(id) == 0) {
-      unsigned pos = id->processed;
-      unsigned mark = id->istart;
-      res = Search_Header(id);
-      id->processed = pos;
-      id->istart = mark;
-
-      if(id->new_header == 1) {
-          res = PDMP3_NEW_FORMAT;
-      }
+      res = Probe_Header(id);
     }
+#endif
   }
   return res;
 }
@@ -2534,20 +4094,1096 @@ int pdmp3_getformat(pdmp3_handle *id,long *rate,int *channels,int *encoding){
   return(PDMP3_ERR);
 }
 
+/**Description: Makes pdmp3_read() decode one granule(576 samples per
+                channel)at a time. The samples of granule 0 can then be read
+                before granule 1 is decoded,which halves the output latency
+                for callers reading less than a frame at a time. The setting
+                is kept by pdmp3_open_feed(). pdmp3_batch_decode() always
+                decodes whole frames.
+* Parameters: Stream handle,nonzero to enable granule output.
+* Return value: PDMP3_OK or PDMP3_ERR
+**/
+int pdmp3_set_granule_output(pdmp3_handle *id,int enable){
+  if(id) {
+    id->granule_output =(enable != 0);
+    return(PDMP3_OK);
+  }
+  return(PDMP3_ERR);
+}
+
+/**Description: Decode the next frame into a buffer owned by the handle,like
+                mpg123_decode_frame(). The samples stay valid until the next
+                call that decodes on this handle. Returns what pdmp3_read()
+                left of a frame first,if anything.
+* Parameters: Stream handle,pointer to store the number of the frame(from 0,
+              may be NULL),pointers to store the address and size in bytes
+              of the interleaved S16 samples.
+* Return value: PDMP3_OK,PDMP3_NEW_FORMAT,PDMP3_NEED_MORE or an error.
+**/
+int pdmp3_decode_frame(pdmp3_handle *id,off_t *num,unsigned char **audio,size_t *bytes){
+  int res = PDMP3_OK,nch;
+
+  if(!id || !audio || !bytes) return(PDMP3_ERR);
+  *audio = NULL;
+  *bytes = 0;
+  if(!id->ostart && !id->granule_next) {
+    res = Next_Frame(id);
+    if(res != PDMP3_OK && res != PDMP3_NEW_FORMAT) return(res);
+  }
+  nch =(id->g_frame_header.mode == mpeg1_mode_single_channel ? 1 : 2);
+  if(id->ostart) { /* Left over by pdmp3_read() */
+    *audio =(unsigned char *)(OUT_STAGE(id) + id->ostart*nch);
+    *bytes =(id->olen - id->ostart)*nch*sizeof(int16_t);
+    id->ostart = 0;
+  }else if(id->granule_next) {
+    Decode_L3_Stage(id,1,1);
+    id->granule_next = 0;
+    *audio =(unsigned char *) OUT_STAGE(id);
+    *bytes = 576*nch*sizeof(int16_t);
+  }else{
+    Decode_L3_Stage(id,0,2);
+    *audio =(unsigned char *) OUT_STAGE(id);
+    *bytes = 2*576*nch*sizeof(int16_t);
+  }
+  if(num) *num = id->frame_num - 1;
+  if(id->new_header == 1 && res == PDMP3_OK) res = PDMP3_NEW_FORMAT;
+  return(res);
+}
+
+/**Description: Decode all complete frames fed so far,handing each one to a
+                callback in place.
+* Parameters: Stream handle,function called with the context,the frame
+              number,the interleaved S16 samples,the samples per channel
+              and the number of channels,its context.
+* Return value: PDMP3_NEED_MORE once all frames are decoded,or an error.
+**/
+int pdmp3_decode_frames(pdmp3_handle *id,pdmp3_frame_fn fn,void *ctx){
+  unsigned char *audio;
+  size_t bytes;
+  off_t num;
+  int res,nch;
+
+  if(!id || !fn) return(PDMP3_ERR);
+  while(((res = pdmp3_decode_frame(id,&num,&audio,&bytes)) == PDMP3_OK) ||
+        (res == PDMP3_NEW_FORMAT)) {
+    nch =(id->g_frame_header.mode == mpeg1_mode_single_channel ? 1 : 2);
+    fn(ctx,num,(const int16_t *) audio,bytes /(nch*sizeof(int16_t)),nch);
+  }
+  return(res);
+}
+
+/**Description: Decode the samples [start,end) of an MP3 file held in memory.
+                Only the headers and side info of the frames before the range
+                are parsed. The main data of the last SKIP_PRIME of them is
+                read as well,for the bit reservoir(511 bytes even at 32
+                kbit/s) and the scalefactors,and the last one is decoded for
+                the overlap and synthesis state,so the output matches the
+                same samples of a full decode. The handle is reset first and
+                must be reopened with pdmp3_open_feed() before it is fed
+                again.
+* Parameters: Stream handle,the MP3 data and its size,the first sample and
+              the sample after the last one(per channel,counted like the
+              output of pdmp3_read()),a buffer for the interleaved S16
+              samples,its size in bytes,a pointer to return the number of
+              bytes decoded.
+* Return value: PDMP3_OK if the range or the file ended,PDMP3_NO_SPACE if
+                the buffer filled up first,or PDMP3_ERR.
+**/
+int pdmp3_decode_range(pdmp3_handle *id,const unsigned char *mp3,size_t size,off_t start,off_t end,unsigned char *out,size_t outsize,size_t *done){
+  off_t frame = 0,first,s0,s1;
+  size_t pos = 0,n,free;
+  unsigned nch;
+  int res;
+
+  if(!id || !mp3 || !out || !done ||(start < 0) ||(end < start)) return(PDMP3_ERR);
+  *done = 0;
+  pdmp3_open_feed(id);
+  first = start / 1152;
+  for(;;) {
+    if(frame * 1152 >= end) return(PDMP3_OK);
+    /* Keep the input buffer full,a frame is read once it is complete */
+    free = INBUF_SIZE - 1 - Get_Inbuf_Filled(id); /* A full ring looks empty */
+    n =(size - pos < free) ? size - pos : free;
+    if(n) {
+      Inbuf_Write(id->in,id->istart,&id->iend,mp3 + pos,n);
+      pos += n;
+    }
+    id->input_end =(pos == size);
+    if(Frame_Ready(id) != PDMP3_OK) return(PDMP3_OK); /* End of the file */
+    if(frame + 1 < first) { /* Before the range,headers and side info only */
+      res = Skip_Frame(id,frame + SKIP_PRIME >= first);
+      if(res == PDMP3_OK) frame++;
+      else if(res != PDMP3_NEED_MORE) return(PDMP3_OK);
+      continue;
+    }
+    res = Read_Next_Frame(id);
+    if(res == PDMP3_NEED_MORE) continue; /* Skipped a frame,refill */
+    if(res != PDMP3_OK && res != PDMP3_NEW_FORMAT) return(PDMP3_OK);
+    Decode_L3_Stage(id,0,2);
+    id->frame_num = ++frame;
+    if(frame <= first) continue; /* Only primes the overlap and synthesis */
+    /* Trim the frame to the range */
+    nch =(id->g_frame_header.mode == mpeg1_mode_single_channel ? 1 : 2);
+    s0 =(start >(frame - 1)*1152) ? start -(frame - 1)*1152 : 0;
+    s1 =(end < frame*1152) ? end -(frame - 1)*1152 : 1152;
+    n =(s1 - s0)*nch*sizeof(int16_t);
+    if(n > outsize - *done) {
+      n = outsize - *done;
+      n -= n %(nch*sizeof(int16_t));
+      memcpy(out + *done,OUT_STAGE(id) + s0*nch,n);
+      *done += n;
+      return(PDMP3_NO_SPACE);
+    }
+    memcpy(out + *done,OUT_STAGE(id) + s0*nch,n);
+    *done += n;
+  }
+}
+
+/**Description: Skip the next n frames,for a consumer that fell behind or
+                seeks forward. Only the headers and side info of the frames
+                are parsed,apart from the last SKIP_PRIME,whose main data is
+                read for the bit reservoir and the scalefactors. The last
+                frame is decoded without output to prime the overlap and
+                synthesis state,so the frames after it decode as if none
+                had been skipped. What pdmp3_read() left of the current
+                frame is dropped. With PDMP3_PIPELINE the parser thread has
+                parsed the frames already,they are only not decoded.
+* Parameters: Stream handle,number of frames,pointer to return the number of
+              frames skipped(may be NULL).
+* Return value: PDMP3_OK,PDMP3_NEED_MORE if the input ran out first(call
+                again with the frames still to skip),or an error.
+**/
+int pdmp3_skip_frames(pdmp3_handle *id,unsigned n,unsigned *skipped){
+  unsigned count = 0;
+  int res;
+
+  if(!id) return(PDMP3_ERR);
+  if(skipped) *skipped = 0;
+  id->ostart = 0;
+  if(id->granule_next) { /* Finish the frame for the overlap state */
+    Decode_L3_Stage(id,1,1);
+    id->granule_next = 0;
+  }
+  while(count < n) {
+#ifndef PDMP3_PIPELINE
+    if(count + 1 < n) {
+      if(Frame_Ready(id) != PDMP3_OK) return(PDMP3_NEED_MORE);
+      res = Skip_Frame(id,count + SKIP_PRIME >= n);
+      if(res == PDMP3_NEED_MORE) continue; /* Dropped,as by Read_Next_Frame() */
+      if(res != PDMP3_OK) return(res);
+      id->frame_num++;
+      if(skipped) *skipped = ++count;
+      continue;
+    }
+#endif
+    res = Next_Frame(id);
+    if(res != PDMP3_OK && res != PDMP3_NEW_FORMAT) return(res);
+    if(++count == n) Decode_L3_Stage(id,0,2);
+    if(skipped) *skipped = count;
+  }
+  return(PDMP3_OK);
+}
+
+/**Description: Get the time spent in each decoder stage since the stream
+                was opened.
+* Parameters: Stream handle,pointer to store the stage statistics.
+* Return value: PDMP3_OK or PDMP3_ERR if compiled without PDMP3_STAGE_STATS. **/
+int pdmp3_get_stage_stats(pdmp3_handle *id,pdmp3_stage_stats *stats){
+  if(id && stats) {
+#ifdef PDMP3_STAGE_STATS
+    *stats = id->stage_stats;
+#ifdef PDMP3_PIPELINE
+    { /* The parse stages are timed on the parser thread */
+      int i;
+      for(i = 0; i < PDMP3_STAGE_NUM; i++)
+        stats->cycles[i] += id->pipeline->parse.stage_stats.cycles[i];
+    }
+#endif
+    return(PDMP3_OK);
+#else
+    memset(stats,0,sizeof(*stats));
+#endif
+  }
+  return(PDMP3_ERR);
+}
+
+/**Description: Get the decoder event counters of a stream since it was
+                opened,as a snapshot. The counters are always kept,they cost
+                an add per event.
+* Parameters: Stream handle,pointer to store the counters.
+* Return value: PDMP3_OK or PDMP3_ERR.
+**/
+int pdmp3_get_stats(pdmp3_handle *id,pdmp3_stats *stats){
+  if(id && stats) {
+    *stats = id->stats;
+#ifdef PDMP3_PIPELINE
+    { /* Frames are parsed on the parser thread */
+      const pdmp3_stats *ps = &id->pipeline->parse.stats;
+      stats->underflows += ps->underflows;
+      stats->sync_losses += ps->sync_losses;
+      stats->skipped_bytes += ps->skipped_bytes;
+      stats->huffman_errors += ps->huffman_errors;
+    }
+#endif
+    return(PDMP3_OK);
+  }
+  return(PDMP3_ERR);
+}
+
+/*#############################################################################
+ * Batch decoding: the DSP back end of several streams runs in lockstep. Every
+ * channel of every stream is a lane; slot s uses lanes 2s and 2s+1. The
+ * hybrid and subband synthesis state is kept as a structure of arrays in
+ * groups of BATCH_VEC lanes,[..][lane],so one vector operation of the
+ * synthesis kernels applies the same table value to all lanes of a group.
+ * Parsing and the per-stream spectral stages(requantize to antialias) still
+ * run per stream.
+ */
+#define BATCH_LANES  (2*PDMP3_BATCH_MAX)
+#ifdef __AVX__
+#define BATCH_VEC    8   /* Lanes per kernel call,one vector register */
+#else
+#define BATCH_VEC    4
+#endif
+#define BATCH_GROUPS (BATCH_LANES/BATCH_VEC)
+#define BATCH_IDLE   0xff /* Block type of lanes without data */
+
+/* One sample of BATCH_VEC lanes. Arithmetic on it is elementwise,so every
+ * lane is rounded exactly as the scalar code rounds a channel. */
+typedef float t_lanes __attribute__((vector_size(BATCH_VEC*sizeof(float))));
+static const t_lanes g_lanes_zero;
+
+typedef struct { /* BATCH_VEC lanes,lane l of the batch is [l % BATCH_VEC] */
+  t_lanes x[576];                       /* Granule being synthesized */
+  t_lanes store[32][18];                /* Overlap add state */
+  t_lanes v_vec[1024];                  /* Polyphase synthesis state,a ring */
+  t_lanes saved_store[32][18];
+  t_lanes saved_v_vec[1024];
+  unsigned char bt[32][BATCH_VEC];      /* Block type per subband */
+  int16_t pcm[2][576][BATCH_VEC];       /* Samples of the frame */
+  unsigned v_off;                       /* Ring position of v_vec[0] */
+  unsigned clipped[BATCH_VEC];          /* Samples clipped per lane */
+  unsigned busy,idle;                   /* Lanes with and without a frame */
+} t_batch_group;
+
+struct pdmp3_batch {
+  t_batch_group g[BATCH_GROUPS];
+  pdmp3_handle *id[PDMP3_BATCH_MAX];
+  unsigned generation[PDMP3_BATCH_MAX]; /* Of the handle when attached */
+};
+
+/**Description: moves the synthesis state of a handle into its lanes,or back.
+* Parameters: Batch,slot,direction(1 = handle to lanes).
+* Return value: None
+**/
+static void Batch_Swap_State(pdmp3_batch *b,unsigned slot,int in){
+  pdmp3_handle *id = b->id[slot];
+  t_batch_group *g = &b->g[2*slot / BATCH_VEC];
+  unsigned sb,i,ch,l,r;
+
+  for(ch = 0; ch < 2; ch++) {
+    l =(2*slot + ch) % BATCH_VEC;
+    for(sb = 0; sb < 32; sb++)
+      for(i = 0; i < 18; i++) {
+        if(in) g->store[sb][i][l] = id->store[sb][i][ch];
+        else id->store[sb][i][ch] = g->store[sb][i][l];
+      }
+    for(i = 0; i < 1024; i++) {
+      r =(i + g->v_off) & 1023;
+      if(in) g->v_vec[r][l] = id->v_vec[i][ch];
+      else id->v_vec[i][ch] = g->v_vec[r][l];
+    }
+  }
+}
+
+#ifdef IMDCT_NTABLES
+/**Description: IMDCT and windowing of one subband in BATCH_VEC lanes.
+* Parameters: Input vectors,output vectors,block type.
+* Return value: None
+**/
+static void Batch_IMDCT_Win(const t_lanes in[18],t_lanes out[36],unsigned block_type){
+  const float *w = g_imdct_win[block_type];
+  unsigned i,m,p;
+  t_lanes sum0,sum1,sum2,sum3; /* Four outputs at a time,independent add chains */
+
+  if(block_type == 2) { /* 3 short blocks */
+    memset(out,0,36*sizeof(t_lanes));
+    for(i = 0; i < 3; i++) {
+      for(p = 0; p < 12; p += 4) {
+        sum0 = sum1 = sum2 = sum3 = g_lanes_zero;
+        for(m = 0; m < 6; m++) {
+          sum0 += in[i+3*m] * cos_N12[m][p];
+          sum1 += in[i+3*m] * cos_N12[m][p+1];
+          sum2 += in[i+3*m] * cos_N12[m][p+2];
+          sum3 += in[i+3*m] * cos_N12[m][p+3];
+        }
+        out[6*i+p+6] += sum0 * w[p];
+        out[6*i+p+7] += sum1 * w[p+1];
+        out[6*i+p+8] += sum2 * w[p+2];
+        out[6*i+p+9] += sum3 * w[p+3];
+      }
+    } /* end for(i... */
+  }else{ /* block_type != 2 */
+    for(p = 0; p < 36; p += 4){
+      sum0 = sum1 = sum2 = sum3 = g_lanes_zero;
+      for(m = 0; m < 18; m++) {
+        sum0 += in[m] * cos_N36[m][p];
+        sum1 += in[m] * cos_N36[m][p+1];
+        sum2 += in[m] * cos_N36[m][p+2];
+        sum3 += in[m] * cos_N36[m][p+3];
+      }
+      out[p] = sum0 * w[p];
+      out[p+1] = sum1 * w[p+1];
+      out[p+2] = sum2 * w[p+2];
+      out[p+3] = sum3 * w[p+3];
+    }
+  }
+}
+#endif /* IMDCT_NTABLES */
+
+/**Description: hybrid synthesis and frequency inversion of BATCH_VEC lanes.
+                Subbands with one block type in all busy lanes share a
+                Batch_IMDCT_Win() pass.
+* Parameters: Lane group.
+* Return value: None
+**/
+static void Batch_Hybrid_Synthesis(t_batch_group *g){
+  t_lanes rawout[36];
+  float in[18],out[36];
+  unsigned sb,i,l,t;
+
+  for(sb = 0; sb < 32; sb++) {
+    t = BATCH_IDLE; /* Common block type of the lanes,if any */
+    for(l = 0; l < BATCH_VEC; l++)
+      if(g->bt[sb][l] != BATCH_IDLE) {
+        if(t == BATCH_IDLE) t = g->bt[sb][l];
+        else if(t != g->bt[sb][l]) break;
+      }
+#ifdef IMDCT_NTABLES
+    if(l == BATCH_VEC) {
+      Batch_IMDCT_Win(&g->x[sb*18],rawout,t == BATCH_IDLE ? 0 : t);
+    }else
+#endif
+    { /* Block types differ between lanes */
+      for(l = 0; l < BATCH_VEC; l++) {
+        for(i = 0; i < 18; i++) in[i] = g->x[sb*18 + i][l];
+        IMDCT_Win(in,out,g->bt[sb][l] == BATCH_IDLE ? 0 : g->bt[sb][l]);
+        for(i = 0; i < 36; i++) rawout[i][l] = out[i];
+      }
+    }
+    for(i = 0; i < 18; i++) { /* Overlap add,invert odd samples of odd subbands */
+      g->x[sb*18 + i] = rawout[i] + g->store[sb][i];
+      g->store[sb][i] = rawout[i + 18];
+      if((sb & i) & 1) g->x[sb*18 + i] = -g->x[sb*18 + i];
+    }
+  }
+}
+
+/**Description: polyphase subband synthesis of a granule in BATCH_VEC lanes.
+                v_vec is a ring starting at v_off,so shifting it is a move
+                of v_off. The windowed U vector is summed as it is built,in
+                the order L3_Subband_Synthesis() sums it.
+* Parameters: Lane group,output samples.
+* Return value: None
+**/
+static void Batch_Subband_Synthesis(t_batch_group *g,int16_t pcm[576][BATCH_VEC]){
+  t_lanes sum[4],x,*v;
+  const float *w;
+  int32_t samp;
+  unsigned i,j,k,n,ss,l,off;
+
+  for(ss = 0; ss < 18; ss++){ /* Loop through 18 samples in 32 subbands */
+    off = g->v_off =(g->v_off - 64) & 1023; /* Shift up the V vector */
+    for(i = 0; i < 64; i += 4){ /* Matrix multiply input with n_win[][] matrix */
+      sum[0] = sum[1] = sum[2] = sum[3] = g_lanes_zero; /* Independent add chains */
+      for(j = 0; j < 32; j++) {
+        x = g->x[j*18 + ss];
+        sum[0] += g_synth_n_win[i][j] * x;
+        sum[1] += g_synth_n_win[i+1][j] * x;
+        sum[2] += g_synth_n_win[i+2][j] * x;
+        sum[3] += g_synth_n_win[i+3][j] * x;
+      }
+      v = &g->v_vec[(off + i) & 1023]; /* off and i are multiples of 4 */
+      v[0] = sum[0];
+      v[1] = sum[1];
+      v[2] = sum[2];
+      v[3] = sum[3];
+    } /* end for(i... */
+    for(i = 0; i < 32; i += 4) { /* Calc 32 samples per lane */
+      sum[0] = sum[1] = sum[2] = sum[3] = g_lanes_zero;
+      for(k = 0; k < 16; k++) { /* Even k: V[128*(k/2) + i],odd k: 96 further */
+        v = &g->v_vec[(off + ((k >> 1) << 7) + i +(k & 1)*96) & 1023];
+        w = &g_synth_dtbl[(k << 5) + i];
+        sum[0] += v[0] * w[0];
+        sum[1] += v[1] * w[1];
+        sum[2] += v[2] * w[2];
+        sum[3] += v[3] * w[3];
+      }
+      for(n = 0; n < 4; n++)
+        for(l = 0; l < BATCH_VEC; l++) {
+          samp =(int32_t)(sum[n][l] * 32767.0);
+          g->clipped[l] +=(samp > 32767) |(samp < -32767);
+          if(samp > 32767) samp = 32767;
+          else if(samp < -32767) samp = -32767;
+          pcm[32*ss + i + n][l] = samp;
+        }
+    } /* end for(i... */
+  } /* end for(ss... */
+}
+
+/**Description: Create a batch for lockstep decoding.
+* Parameters: None
+* Return value: Batch or NULL
+**/
+pdmp3_batch *pdmp3_batch_new(void){
+  pdmp3_batch *b;
+
+  if(posix_memalign((void **)&b,64,sizeof(pdmp3_batch)) != 0) return(NULL);
+  memset(b,0,sizeof(pdmp3_batch));
+  return(b);
+}
+
+/**Description: Free a batch. Attached handles get their state back.
+* Parameters: Batch
+* Return value: None
+**/
+void pdmp3_batch_delete(pdmp3_batch *b){
+  unsigned s;
+
+  if(b) {
+    for(s = 0; s < PDMP3_BATCH_MAX; s++) pdmp3_batch_attach(b,s,NULL);
+    free(b);
+  }
+}
+
+/**Description: Attach a stream to a slot of the batch,or detach the stream
+                in the slot if id is NULL. An attached stream must only be
+                decoded through pdmp3_batch_decode().
+* Parameters: Batch,slot(0 to PDMP3_BATCH_MAX-1),stream handle or NULL.
+* Return value: PDMP3_OK or PDMP3_ERR
+**/
+int pdmp3_batch_attach(pdmp3_batch *b,unsigned slot,pdmp3_handle *id){
+  if(!b || slot >= PDMP3_BATCH_MAX) return(PDMP3_ERR);
+  if(b->id[slot]) Batch_Swap_State(b,slot,0);
+  b->id[slot] = id;
+  if(id) {
+    b->generation[slot] = id->generation;
+    Batch_Swap_State(b,slot,1);
+  }
+  return(PDMP3_OK);
+}
+
+/**Description: Decode the next frame of every attached stream. Streams
+                without a complete frame keep their state.
+* Parameters: Batch,per slot: a buffer of at least PDMP3_BATCH_FRAME bytes
+              for the PCM data,a pointer to return the number of bytes
+              decoded,a pointer to return the status as pdmp3_read() would.
+* Return value: Number of streams that decoded a frame.
+**/
+int pdmp3_batch_decode(pdmp3_batch *b,unsigned char *out[],size_t done[],int res[]){
+  unsigned char ready[PDMP3_BATCH_MAX];
+  unsigned s,l,gr,ch,sb,i,nch,n = 0,old_off[BATCH_GROUPS];
+  pdmp3_handle *id;
+  t_batch_group *g;
+  unsigned char *o;
+
+  for(g = b->g; g < b->g + BATCH_GROUPS; g++) {
+    g->busy = g->idle = 0;
+    memset(g->clipped,0,sizeof(g->clipped));
+  }
+  for(s = 0; s < PDMP3_BATCH_MAX; s++) {
+    ready[s] = 0;
+    done[s] = 0;
+    if(!(id = b->id[s])) {
+      res[s] = PDMP3_ERR;
+      continue;
+    }
+    g = &b->g[2*s / BATCH_VEC];
+    res[s] = Next_Frame(id);
+    if(res[s] == PDMP3_OK || res[s] == PDMP3_NEW_FORMAT) {
+      if(id->new_header == 1) res[s] = PDMP3_NEW_FORMAT;
+      if(id->generation != b->generation[s]) { /* Reopened,the lanes are stale */
+        b->id[s] = NULL;
+        pdmp3_batch_attach(b,s,id);
+      }
+      id->dirty |= HANDLE_DIRTY_SYNTH;
+      ready[s] = 1;
+      g->busy++;
+      n++;
+    }else g->idle++;
+  }
+  if(n == 0) return(0);
+  for(g = b->g; g < b->g + BATCH_GROUPS; g++) {
+    old_off[g - b->g] = g->v_off;
+    if(g->busy && g->idle) { /* Lanes without a frame must keep their state */
+      memcpy(g->saved_store,g->store,sizeof(g->store));
+      memcpy(g->saved_v_vec,g->v_vec,sizeof(g->v_vec));
+    }
+  }
+  for(gr = 0; gr < 2; gr++) {
+    for(s = 0; s < PDMP3_BATCH_MAX; s++) {
+      id = b->id[s];
+      g = &b->g[2*s / BATCH_VEC];
+      if(!g->busy) continue;
+      nch = 0;
+      if(ready[s]) {
+        nch =(id->g_frame_header.mode == mpeg1_mode_single_channel ? 1 : 2);
+        L3_Spectrum(id,gr);
+      }
+      for(ch = 0; ch < 2; ch++) {
+        l =(2*s + ch) % BATCH_VEC;
+        if(ch < nch) {
+          for(i = 0; i < 576; i++) g->x[i][l] = id->g_main_data.is[gr][ch][i];
+          for(sb = 0; sb < 32; sb++)
+            g->bt[sb][l] =((id->g_side_info.win_switch_flag[gr][ch] == 1) &&
+             (id->g_side_info.mixed_block_flag[gr][ch] == 1) &&(sb < 2))
+              ? 0 : id->g_side_info.block_type[gr][ch];
+        }else{ /* Idle lane */
+          for(i = 0; i < 576; i++) g->x[i][l] = 0.0;
+          for(sb = 0; sb < 32; sb++) g->bt[sb][l] = BATCH_IDLE;
+        }
+      }
+    }
+    for(g = b->g; g < b->g + BATCH_GROUPS; g++)
+      if(g->busy) Batch_Hybrid_Synthesis(g);
+    for(s = 0; s < PDMP3_BATCH_MAX; s++) /* Leave is[] as Decode_L3() does,Read_Huffman() keeps parts of it */
+      if(ready[s]) {
+        id = b->id[s];
+        g = &b->g[2*s / BATCH_VEC];
+        nch =(id->g_frame_header.mode == mpeg1_mode_single_channel ? 1 : 2);
+        for(ch = 0; ch < nch; ch++)
+          for(i = 0; i < 576; i++)
+            id->g_main_data.is[gr][ch][i] = g->x[i][(2*s + ch) % BATCH_VEC];
+      }
+    for(g = b->g; g < b->g + BATCH_GROUPS; g++)
+      if(g->busy) Batch_Subband_Synthesis(g,g->pcm[gr]);
+  }
+  for(s = 0; s < PDMP3_BATCH_MAX; s++) {
+    g = &b->g[2*s / BATCH_VEC];
+    if(!ready[s]) {
+      if(b->id[s] && g->busy) { /* Undo the synthesis of idle lanes */
+        for(l = 2*s % BATCH_VEC; l < 2*s % BATCH_VEC + 2; l++) {
+          for(sb = 0; sb < 32; sb++)
+            for(i = 0; i < 18; i++)
+              g->store[sb][i][l] = g->saved_store[sb][i][l];
+          for(i = 0; i < 1024; i++)
+            g->v_vec[(i + g->v_off) & 1023][l] =
+              g->saved_v_vec[(i + old_off[g - b->g]) & 1023][l];
+        }
+      }
+      continue;
+    }
+    id = b->id[s];
+    nch =(id->g_frame_header.mode == mpeg1_mode_single_channel ? 1 : 2);
+    o = out[s];
+    for(gr = 0; gr < 2; gr++)
+      for(i = 0; i < 576; i++)
+        for(ch = 0; ch < nch; ch++) { /* out[s] needn't be int16_t aligned */
+          memcpy(o,&g->pcm[gr][i][2*s % BATCH_VEC + ch],sizeof(int16_t));
+          o += sizeof(int16_t);
+        }
+    done[s] = 2*576*nch*sizeof(int16_t);
+    id->stats.frames++;
+    for(ch = 0; ch < nch; ch++) id->stats.clipped += g->clipped[2*s % BATCH_VEC + ch];
+  }
+  return(n);
+}
+
 /*#############################################################################
  * mp3s must be NULL terminated
  */
+#define OUTBUF_SIZE (4*4096) /* PCM bytes per pdmp3_read() */
+
+#if defined(PDMP3_URING) && !defined(OUTPUT_SOUND) && \
+   (defined(OUTPUT_RAW) || defined(OUTPUT_WAV))
+/* Batch conversion of many files. Each worker thread owns an io_uring which
+ * keeps the opens,reads and writes of URING_JOBS files in flight,and decodes
+ * whichever of its files has input while the others wait for the disk. The
+ * ring is driven through the raw system calls,liburing is not needed. */
+#define URING_JOBS      8           /* Files in flight per worker */
+#define URING_ENTRIES   64          /* >= URING_JOBS * ops in flight per file */
+#define URING_WORKERS   64          /* Max. worker threads */
+#define URING_READ_SIZE (64*1024)   /* MP3 bytes per read */
+#define URING_OUT_SIZE  (256*1024)  /* PCM bytes per write */
+#define URING_OUT_BUFS  2           /* Blocks per file,plus one for the header */
+
+/* Operation in the low bits of user_data,the job index above them */
+enum { URING_OPEN_IN,URING_OPEN_OUT,URING_READ,URING_WRITE };
+#define URING_DATA(job,op,buf) (((uint64_t)(job) << 8) |((op) << 4) |(buf))
+
+typedef struct {
+  int fd;
+  unsigned *sq_head,*sq_tail,*sq_mask,*sq_array;
+  unsigned *cq_head,*cq_tail,*cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_map,*cq_map;
+  size_t sq_size,cq_size,sqes_size;
+  unsigned pending;  /* Entries queued but not submitted */
+}
+t_uring;
+
+typedef struct {
+  const char *filename;
+  char outname[1024];
+  pdmp3_handle *id;
+  int in,out;               /* -1 if not open */
+  unsigned inflight;        /* Operations not completed */
+  char failed,done;         /* done: nothing left to submit */
+  /* Input,double buffered so one read is in flight while decoding */
+  unsigned char *rbuf[2];
+  size_t rlen[2];
+  char rfull[2];            /* Holds data not fed to the decoder yet */
+  unsigned rcur;            /* Buffer being fed */
+  size_t rpos;              /* Bytes of rbuf[rcur] fed */
+  char reading,eof,ended;   /* ended: pdmp3_feed_end() was called */
+  uint64_t roff;            /* File offset of the next read */
+  /* Output blocks,the last one holds the WAV header */
+  unsigned char *wbuf[URING_OUT_BUFS + 1];
+  size_t wlen[URING_OUT_BUFS + 1],wdone[URING_OUT_BUFS + 1];
+  uint64_t wat[URING_OUT_BUFS + 1];  /* File offset of each block */
+  unsigned wbusy;           /* Bit mask of blocks being written */
+  unsigned wcur;            /* Block being filled */
+  size_t wfill;
+  uint64_t woff;            /* File offset of the next block */
+  uint64_t size;            /* PCM bytes */
+  unsigned rate,nch;        /* Format of the first frame */
+}
+t_uring_job;
+
+typedef struct {
+  pthread_t thread;
+  t_uring ring;
+  t_uring_job job[URING_JOBS];
+}
+t_uring_worker;
+
+static struct {
+  char * const *files;
+  unsigned count;
+  unsigned next;            /* Next file to claim,shared by the workers */
+}
+g_uring;
+
+/**Description: sets up an io_uring and maps its rings.
+* Parameters: Ring,number of submission entries.
+* Return value: PDMP3_OK or PDMP3_ERR if the kernel has no io_uring.
+**/
+static int Uring_Setup(t_uring *r,unsigned entries){
+  struct io_uring_params p;
+  unsigned char *sq,*cq;
+
+  memset(&p,0,sizeof(p));
+  memset(r,0,sizeof(*r));
+  r->fd = syscall(__NR_io_uring_setup,entries,&p);
+  if(r->fd < 0) return(PDMP3_ERR);
+  r->sq_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+  r->cq_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+  if(p.features & IORING_FEAT_SINGLE_MMAP) {
+    if(r->cq_size > r->sq_size) r->sq_size = r->cq_size;
+    r->cq_size = 0;
+  }
+  r->sq_map = mmap(NULL,r->sq_size,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,
+                   r->fd,IORING_OFF_SQ_RING);
+  r->cq_map = r->cq_size ?
+    mmap(NULL,r->cq_size,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,
+         r->fd,IORING_OFF_CQ_RING) : r->sq_map;
+  r->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL,r->sqes_size,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,
+                 r->fd,IORING_OFF_SQES);
+  if(r->sq_map == MAP_FAILED || r->cq_map == MAP_FAILED || r->sqes == MAP_FAILED)
+    Error("Unable to map the io_uring\n",-1);
+  sq = r->sq_map;
+  cq = r->cq_map;
+  r->sq_head = (unsigned *)(sq + p.sq_off.head);
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return(PDMP3_OK);
+}
+
+static void Uring_Free(t_uring *r){
+  munmap(r->sqes,r->sqes_size);
+  if(r->cq_size) munmap(r->cq_map,r->cq_size);
+  munmap(r->sq_map,r->sq_size);
+  close(r->fd);
+}
+
+/**Description: submits the queued entries and optionally waits.
+* Parameters: Ring,number of completions to wait for.
+* Return value: None,exits on error.
+**/
+static void Uring_Enter(t_uring *r,unsigned wait){
+  int res;
+
+  do {
+    res = syscall(__NR_io_uring_enter,r->fd,r->pending,wait,
+                  wait ? IORING_ENTER_GETEVENTS : 0,NULL,0);
+  } while(res < 0 && errno == EINTR);
+  if(res < 0) Error("io_uring_enter failed\n",-1);
+  r->pending -= res;
+}
+
+/**Description: queues one operation,submitting the queue first if it is
+                full.
+* Parameters: Ring,opcode,file descriptor,buffer or path,length or mode,
+              file offset or open flags,IOSQE_* flags,user data.
+* Return value: None
+**/
+static void Uring_Queue(t_uring *r,unsigned op,int fd,const void *addr,unsigned len,uint64_t off,unsigned flags,uint64_t data){
+  struct io_uring_sqe *sqe;
+  unsigned tail = *r->sq_tail;
+
+  while(tail - __atomic_load_n(r->sq_head,__ATOMIC_ACQUIRE) > *r->sq_mask)
+    Uring_Enter(r,0);
+  sqe = &r->sqes[tail & *r->sq_mask];
+  memset(sqe,0,sizeof(*sqe));
+  sqe->opcode = op;
+  sqe->flags = flags;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t) addr;
+  sqe->len = len;
+  if(op == IORING_OP_OPENAT) sqe->open_flags = off;
+  else sqe->off = off;
+  sqe->user_data = data;
+  r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+  __atomic_store_n(r->sq_tail,tail + 1,__ATOMIC_RELEASE);
+  r->pending++;
+}
+
+/**Description: claims the next file and queues the opens of it and its
+                output file.
+* Parameters: Worker,job index.
+* Return value: 0 if no file is left.
+**/
+static int Uring_Start(t_uring_worker *w,unsigned j){
+  t_uring_job *job = &w->job[j];
+  unsigned n = __atomic_fetch_add(&g_uring.next,1,__ATOMIC_RELAXED);
+
+  if(n >= g_uring.count) return(0);
+  job->filename = g_uring.files[n];
+#ifdef OUTPUT_WAV
+  snprintf(job->outname,sizeof(job->outname),"%s.wav",job->filename);
+  job->woff = WAV_HEADER_SIZE; /* The header is written last */
+#else
+  snprintf(job->outname,sizeof(job->outname),"%s.raw",job->filename);
+  job->woff = 0;
+#endif
+  pdmp3_open_feed(job->id);
+  job->in = job->out = -1;
+  job->failed = job->done = 0;
+  job->rfull[0] = job->rfull[1] = 0;
+  job->rcur = 0;
+  job->rpos = 0;
+  job->reading = job->eof = job->ended = 0;
+  job->roff = 0;
+  job->wbusy = 0;
+  job->wcur = 0;
+  job->wfill = 0;
+  job->size = 0;
+  /* Linked,so no output file is created if the input can't be opened */
+  Uring_Queue(&w->ring,IORING_OP_OPENAT,AT_FDCWD,job->filename,0,O_RDONLY,
+              IOSQE_IO_LINK,URING_DATA(j,URING_OPEN_IN,0));
+  Uring_Queue(&w->ring,IORING_OP_OPENAT,AT_FDCWD,job->outname,0666,
+              O_WRONLY | O_CREAT | O_TRUNC,0,URING_DATA(j,URING_OPEN_OUT,0));
+  job->inflight = 2;
+  return(1);
+}
+
+static void Uring_Write(t_uring_worker *w,unsigned j,unsigned b){
+  t_uring_job *job = &w->job[j];
+
+  job->wbusy |= 1 << b;
+  job->inflight++;
+  Uring_Queue(&w->ring,IORING_OP_WRITE,job->out,job->wbuf[b] + job->wdone[b],
+              job->wlen[b] - job->wdone[b],job->wat[b] + job->wdone[b],0,
+              URING_DATA(j,URING_WRITE,b));
+}
+
+/**Description: queues the next read unless one is in flight,the input has
+                ended or both buffers are full.
+* Parameters: Worker,job index.
+* Return value: None
+**/
+static void Uring_Read_Ahead(t_uring_worker *w,unsigned j){
+  t_uring_job *job = &w->job[j];
+  unsigned b = job->rfull[job->rcur] ? job->rcur ^ 1 : job->rcur;
+
+  if(job->reading || job->eof || job->failed || job->rfull[b]) return;
+  job->reading = 1;
+  job->inflight++;
+  Uring_Queue(&w->ring,IORING_OP_READ,job->in,job->rbuf[b],URING_READ_SIZE,
+              job->roff,0,URING_DATA(j,URING_READ,b));
+}
+
+/**Description: queues the last writes of a file: the partial block and the
+                WAV header.
+* Parameters: Worker,job index.
+* Return value: None
+**/
+static void Uring_Finish(t_uring_worker *w,unsigned j){
+  t_uring_job *job = &w->job[j];
+
+  job->done = 1;
+  if(job->failed) return;
+  if(job->wfill) {
+    job->wlen[job->wcur] = job->wfill;
+    job->wdone[job->wcur] = 0;
+    job->wat[job->wcur] = job->woff;
+    Uring_Write(w,j,job->wcur);
+  }
+#ifdef OUTPUT_WAV
+  if(job->size) {
+    Wav_Header(job->wbuf[URING_OUT_BUFS],job->rate,job->nch,job->size);
+    job->wlen[URING_OUT_BUFS] = WAV_HEADER_SIZE;
+    job->wdone[URING_OUT_BUFS] = 0;
+    job->wat[URING_OUT_BUFS] = 0;
+    Uring_Write(w,j,URING_OUT_BUFS);
+  }
+#endif
+}
+
+/**Description: decodes the input a file has until it needs more input or
+                all its output blocks are being written.
+* Parameters: Worker,job index.
+* Return value: None
+**/
+static void Uring_Decode(t_uring_worker *w,unsigned j){
+  t_uring_job *job = &w->job[j];
+  pdmp3_handle *id = job->id;
+  size_t n,done,free;
+  int res;
+
+  while(!job->done && !job->failed) {
+    if(job->wbusy & (1 << job->wcur)) return; /* Wait for a block */
+    n = URING_OUT_SIZE - job->wfill;
+    if(job->size == 0 && n > OUTBUF_SIZE) n = OUTBUF_SIZE; /* Format as pdmp3() takes it */
+    res = pdmp3_read(id,job->wbuf[job->wcur] + job->wfill,n,&done);
+    if(done && job->size == 0) {
+      job->rate = g_sampling_frequency[id->g_frame_header.sampling_frequency];
+      job->nch = id->g_frame_header.mode == mpeg1_mode_single_channel ? 1 : 2;
+    }
+    job->wfill += done;
+    job->size += done;
+    if(job->wfill == URING_OUT_SIZE) {
+      job->wlen[job->wcur] = URING_OUT_SIZE;
+      job->wdone[job->wcur] = 0;
+      job->wat[job->wcur] = job->woff;
+      job->woff += URING_OUT_SIZE;
+      Uring_Write(w,j,job->wcur);
+      job->wcur = (job->wcur + 1) % URING_OUT_BUFS;
+      job->wfill = 0;
+    }
+    if(res == PDMP3_ERR) Uring_Finish(w,j);
+    else if(res == PDMP3_NEED_MORE) {
+      if(job->rfull[job->rcur] && job->rpos < job->rlen[job->rcur]) {
+#ifdef PDMP3_PIPELINE
+        free = Pipeline_Inbuf_Free(id->pipeline) - 1;
+#else
+        free = Get_Inbuf_Free(id) - 1; /* A full ring looks empty */
+#endif
+        n = job->rlen[job->rcur] - job->rpos;
+        if(n > free) n = free;
+        pdmp3_feed(id,job->rbuf[job->rcur] + job->rpos,n);
+        job->rpos += n;
+        continue;
+      }
+      job->rfull[job->rcur] = 0;
+      if(job->rfull[job->rcur ^ 1]) { /* Read ahead already done */
+        job->rcur ^= 1;
+        job->rpos = 0;
+        Uring_Read_Ahead(w,j);
+        continue;
+      }
+      Uring_Read_Ahead(w,j);
+      if(job->eof && !job->ended) { /* All of it fed */
+        pdmp3_feed_end(id);
+        job->ended = 1;
+        continue;
+      }
+      if(!job->reading) Uring_Finish(w,j); /* End of the input */
+      return;
+    }
+  }
+}
+
+/**Description: handles one completion.
+* Parameters: Worker,user data and result of the completion.
+* Return value: None
+**/
+static void Uring_Complete(t_uring_worker *w,uint64_t data,int res){
+  unsigned j = data >> 8,op =(data >> 4) & 0xf,b = data & 0xf;
+  t_uring_job *job = &w->job[j];
+
+  job->inflight--;
+  switch(op) {
+  case URING_OPEN_IN:
+  case URING_OPEN_OUT:
+    if(res < 0) {
+      if(res != -ECANCELED) /* The input failed to open */
+        fprintf(stderr,"%s: %s\n",op == URING_OPEN_IN ? job->filename : job->outname,
+                strerror(-res));
+      job->failed = 1;
+    }else if(op == URING_OPEN_IN) job->in = res;
+    else job->out = res;
+    if(job->inflight == 0 && !job->failed) Uring_Read_Ahead(w,j);
+    break;
+  case URING_READ:
+    job->reading = 0;
+    if(res < 0) {
+      fprintf(stderr,"%s: %s\n",job->filename,strerror(-res));
+      job->failed = 1;
+      break;
+    }
+    if(res == 0) job->eof = 1;
+    else {
+      job->rfull[b] = 1;
+      job->rlen[b] = res;
+      job->roff += res;
+      if(b == job->rcur) job->rpos = 0;
+      Uring_Read_Ahead(w,j);
+    }
+    Uring_Decode(w,j);
+    break;
+  case URING_WRITE:
+    if(res <= 0) {
+      fprintf(stderr,"%s: %s\n",job->outname,res ? strerror(-res) : "short write");
+      job->failed = 1;
+      job->wbusy &= ~(1 << b);
+      break;
+    }
+    job->wdone[b] += res;
+    job->wbusy &= ~(1 << b);
+    if(job->wdone[b] < job->wlen[b]) Uring_Write(w,j,b);
+    else Uring_Decode(w,j);
+    break;
+  }
+}
+
+/**Description: closes the files of a job once nothing is in flight and
+                starts on the next file.
+* Parameters: Worker,job index.
+* Return value: 0 if the job has no more work.
+**/
+static int Uring_Next(t_uring_worker *w,unsigned j){
+  t_uring_job *job = &w->job[j];
+
+  if(job->inflight) return(1);
+  if(!job->done && !job->failed) return(1);
+  if(job->in != -1) close(job->in);
+  if(job->out != -1) close(job->out);
+  job->in = job->out = -1;
+  return(Uring_Start(w,j));
+}
+
+static void *Uring_Worker(void *arg){
+  t_uring_worker *w = arg;
+  t_uring *r = &w->ring;
+  struct io_uring_cqe *cqe;
+  unsigned j,i,head,active = 0;
+  char busy[URING_JOBS];
+
+  for(j = 0; j < URING_JOBS; j++) {
+    t_uring_job *job = &w->job[j];
+
+    job->id = pdmp3_new(NULL,NULL);
+    if(job->id == NULL) Error("Cannot open stream API (out of memory)",0);
+    for(i = 0; i < 2; i++)
+      if(posix_memalign((void **)&job->rbuf[i],4096,URING_READ_SIZE) != 0)
+        Error("Unable to allocate the input buffers\n",-1);
+    for(i = 0; i <= URING_OUT_BUFS; i++)
+      if(posix_memalign((void **)&job->wbuf[i],4096,
+                        i < URING_OUT_BUFS ? URING_OUT_SIZE : WAV_HEADER_SIZE) != 0)
+        Error("Unable to allocate the output buffers\n",-1);
+    job->in = job->out = -1;
+    busy[j] = Uring_Start(w,j);
+    active += busy[j];
+  }
+  while(active) {
+    Uring_Enter(r,1);
+    head = *r->cq_head;
+    while(head != __atomic_load_n(r->cq_tail,__ATOMIC_ACQUIRE)) {
+      cqe = &r->cqes[head & *r->cq_mask];
+      Uring_Complete(w,cqe->user_data,cqe->res);
+      __atomic_store_n(r->cq_head,++head,__ATOMIC_RELEASE);
+    }
+    for(j = 0; j < URING_JOBS; j++)
+      if(busy[j] && !Uring_Next(w,j)) {
+        busy[j] = 0;
+        active--;
+      }
+  }
+  for(j = 0; j < URING_JOBS; j++) {
+    pdmp3_delete(w->job[j].id);
+    for(i = 0; i < 2; i++) free(w->job[j].rbuf[i]);
+    for(i = 0; i <= URING_OUT_BUFS; i++) free(w->job[j].wbuf[i]);
+  }
+  return(NULL);
+}
+
+/**Description: converts all files on worker threads with io_uring.
+* Parameters: NULL terminated list of files.
+* Return value: PDMP3_OK,or PDMP3_ERR if io_uring is not available and the
+                caller should decode the files itself.
+**/
+static int Uring_Batch(char * const *mp3s){
+  t_uring_worker *w;
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned i,n,nfiles;
+
+  for(nfiles = 0; mp3s[nfiles]; nfiles++)
+    if(!strcmp(mp3s[nfiles],"-")) return(PDMP3_ERR); /* Standard I/O is not batched */
+  n = ncpu < 1 ? 1 : ncpu;
+  if(n > URING_WORKERS) n = URING_WORKERS;
+  if(n >(nfiles + URING_JOBS - 1) / URING_JOBS) n =(nfiles + URING_JOBS - 1) / URING_JOBS;
+  if(n == 0) return(PDMP3_OK);
+  w = calloc(n,sizeof(*w));
+  if(w == NULL) Error("Unable to allocate the workers\n",-1);
+  for(i = 0; i < n; i++)
+    if(Uring_Setup(&w[i].ring,URING_ENTRIES) != PDMP3_OK) {
+      while(i--) Uring_Free(&w[i].ring);
+      free(w);
+      return(PDMP3_ERR);
+    }
+  g_uring.files = mp3s;
+  g_uring.count = nfiles;
+  g_uring.next = 0;
+  for(i = 0; i < n; i++)
+    if(pthread_create(&w[i].thread,NULL,Uring_Worker,&w[i]) != 0)
+      Error("Unable to start the worker threads\n",-1);
+  for(i = 0; i < n; i++) {
+    pthread_join(w[i].thread,NULL);
+    Uring_Free(&w[i].ring);
+  }
+  free(w);
+  return(PDMP3_OK);
+}
+#endif /* PDMP3_URING && !OUTPUT_SOUND && (OUTPUT_RAW || OUTPUT_WAV) */
+
 void pdmp3(char * const *mp3s){
   static const char *filename,*audio_name = "/dev/dsp";
   static FILE *fp =(FILE *) NULL;
-  unsigned char out[INBUF_SIZE];
+  unsigned char outbuf[OUTBUF_SIZE],*out = outbuf;
+  size_t done,outsize = OUTBUF_SIZE;
   pdmp3_handle *id;
-  size_t done;
-  int res;
+  pdmp3_stats st;
+  int res,stats = 0,ended;
 
   if(!strncmp("/dev/dsp",*mp3s,8)){
     audio_name = *mp3s++;
   }
+  if(*mp3s && !strcmp("--stats",*mp3s)){ /* Event counters per file to stderr */
+    stats = 1;
+    mp3s++;
+  }
+#if defined(PDMP3_URING) && !defined(OUTPUT_SOUND) && \
+   (defined(OUTPUT_RAW) || defined(OUTPUT_WAV))
+  if(!stats && Uring_Batch(mp3s) == PDMP3_OK) return;
+#endif
 
   id = pdmp3_new(NULL,NULL);
   if(id == 0)
@@ -2561,8 +5197,19 @@ void pdmp3(char * const *mp3s){
       Error("Cannot open file\n",0);
 
     pdmp3_open_feed(id);
-    while((res = pdmp3_read(id,out,INBUF_SIZE,&done)) != PDMP3_ERR){
+    ended = 0;
+#if defined(OUTPUT_RAW) || defined(OUTPUT_WAV)
+    audio_open_file(filename);
+#endif
+#ifdef OUTPUT_ASYNC
+    out = Async_Open(audio_name,filename,&outsize);
+#endif
+    while((res = pdmp3_read(id,out,outsize,&done)) != PDMP3_ERR){
+#ifdef OUTPUT_ASYNC
+      out = Async_Commit(id,done,&outsize);
+#else
       audio_write(id,audio_name,filename,out,done);
+#endif
       if(res == PDMP3_OK || res == PDMP3_NEW_FORMAT) {
 #ifdef DEBUG
         if(res == PDMP3_NEW_FORMAT) {
@@ -2576,15 +5223,44 @@ void pdmp3(char * const *mp3s){
       }
       else if(res == PDMP3_NEED_MORE){
         unsigned char in[4096];
+#ifdef PDMP3_PIPELINE
+        size_t free = Pipeline_Inbuf_Free(id->pipeline) - 1;
+#else
+        size_t free = Get_Inbuf_Free(id) - 1; /* A full ring looks empty */
+#endif
 
-        res = fread(in,1,4096,fp);
-        if(!res) break;
+        if(free > sizeof(in)) free = sizeof(in);
+        res = fread(in,1,free,fp);
+        if(!res) {
+          if(ended) break;
+          pdmp3_feed_end(id); /* The last frames need no headers after them */
+          ended = 1;
+          continue;
+        }
 
         res = pdmp3_feed(id,in,res);
       }
     }
+#ifdef OUTPUT_ASYNC
+    Async_Close();
+#endif
+#if defined(OUTPUT_RAW) || defined(OUTPUT_WAV)
+    audio_close_file();
+#endif
     fclose(fp);
+    if(stats && pdmp3_get_stats(id,&st) == PDMP3_OK) {
+      fprintf(stderr,"%s: %llu frames decoded,%llu skipped for reservoir underflow,"
+              "%llu sync losses(%llu bytes skipped),%llu illegal Huffman codes,"
+              "%llu samples clipped,%llu feeds without space\n",filename,
+              (unsigned long long) st.frames,(unsigned long long) st.underflows,
+              (unsigned long long) st.sync_losses,(unsigned long long) st.skipped_bytes,
+              (unsigned long long) st.huffman_errors,(unsigned long long) st.clipped,
+              (unsigned long long) st.feed_no_space);
+    }
   }
+#ifdef OUTPUT_ASYNC
+  Async_Stop();
+#endif
   pdmp3_delete(id);
 }
 #endif /* !definend(PDMP3_HEADER_ONLY) */